@@ -2,7 +2,90 @@
 #define _DEFLATE_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include "zstream.h"
 
 int deflate(FILE *src, FILE *dest);
 
+/*	Same as deflate, reading from SRC and writing to DEST through callbacks.
+	Each deflate block is handed to DEST as soon as it is complete.  */
+int deflate_stream(const z_source *src, const z_sink *dest);
+
+/*	Flags of deflate_flags and deflate_stream_flags  */
+#define DEFLATE_F_PROBE 0x1			// probe every block, see deflate_probe
+#define DEFLATE_F_FAST 0x2			// single-probe greedy parse, level 1
+
+/*	Same as deflate and deflate_stream, with the DEFLATE_F_* FLAGS. With
+	DEFLATE_F_PROBE, blocks the probe calls incompressible are stored as
+	they are and those with few matches get a shorter match search. With
+	DEFLATE_F_FAST, matches are looked up with a single probe of a hash
+	table rather than along chains, for speed over ratio.  */
+int deflate_flags(FILE *src, FILE *dest, int flags);
+
+int deflate_stream_flags(const z_source *src, const z_sink *dest, int flags);
+
+/*	Recommendations of deflate_probe  */
+#define DEFLATE_PROBE_STORE 0		// incompressible, store as is
+#define DEFLATE_PROBE_FAST 1		// few matches, search little
+#define DEFLATE_PROBE_NORMAL 2
+
+/*	Guess how well LEN bytes of BUF would compress, from about 4KB sampled
+	across them: their order-0 entropy and how often a single-probe hash
+	finds a match. Costs a small fraction of compressing BUF.  */
+int deflate_probe(const unsigned char *buf, size_t len);
+
+/*	LZ77 parse of a whole input, the half of deflate that searches matches,
+	kept apart from the entropy coding so it can be cached and coded again
+	with another strategy. A literal token is its byte value. A match token
+	packs its length symbol (257 to 285) in bits 0-8, the length extra bits
+	in bits 9-13, the distance code in bits 14-18 and the distance extra bits
+	in bits 19-31; deflate_token builds one. SIZE and ADLER describe the
+	bytes the tokens stand for.  */
+typedef struct deflate_parse_t {
+	uint32_t *tokens;
+	size_t count;
+	size_t capacity;
+	uint64_t size;
+	uint32_t adler;				// adler32 of the SIZE bytes
+} deflate_parse_t;
+
+/*	Empty parse, of no bytes.  */
+void deflate_parse_init(deflate_parse_t *parse);
+
+void deflate_parse_free(deflate_parse_t *parse);
+
+/*	Token of a match of LEN bytes (3 to 258) DIST bytes back (1 to 32768).  */
+uint32_t deflate_token(int len, int dist);
+
+/*	Append TOK to PARSE and count its bytes in SIZE. ADLER is left to the
+	caller, who has the bytes.  */
+void deflate_parse_push(deflate_parse_t *parse, uint32_t tok);
+
+/*	Parse all of SRC the way deflate does into PARSE, which is initialized
+	here. Returns Z_OK or an error code.  */
+int deflate_parse(FILE *src, deflate_parse_t *parse);
+
+int deflate_parse_stream(const z_source *src, deflate_parse_t *parse);
+
+/*	Strategies of deflate_emit  */
+#define DEFLATE_EMIT_FIXED 0		// fixed huffman codes only
+#define DEFLATE_EMIT_DYNAMIC 1		// blocks as deflate cuts and codes them
+#define DEFLATE_EMIT_SPLIT 2		// blocks cut where the statistics change
+
+/*	Write PARSE to DEST as a zlib stream, coded with STRATEGY. A parse of
+	deflate_parse coded with DEFLATE_EMIT_DYNAMIC gives the output of
+	deflate. Returns Z_OK, or INVALID_PARSE if a token is malformed, reaches
+	back before the start or the tokens do not add up to SIZE.  */
+int deflate_emit(const deflate_parse_t *parse, int strategy, FILE *dest);
+
+int deflate_emit_stream(const deflate_parse_t *parse, int strategy,
+	const z_sink *dest);
+
+/*	Serialized parse: "DPAR", SIZE (64 bits), ADLER, COUNT (64 bits), then
+	the tokens, all little-endian. deflate_parse_load initializes PARSE and
+	returns Z_OK, FILE_ERROR or INVALID_PARSE.  */
+int deflate_parse_save(const deflate_parse_t *parse, FILE *dest);
+
+int deflate_parse_load(deflate_parse_t *parse, FILE *src);
+
 #endif  // _DEFLATE_H
@@ -2,7 +2,11 @@
 #define _INFLATE_H
 
 #include <stdio.h>
+#include "zstream.h"
 
 int inflate(FILE *src, FILE *dest);
 
+/*	Same as inflate, reading from SRC and writing to DEST through callbacks.  */
+int inflate_stream(const z_source *src, const z_sink *dest);
+
 #endif  // _INFLATE_H
@@ -0,0 +1,16 @@
+#ifndef _ZALLOC_H
+#define _ZALLOC_H 1
+
+#include <stddef.h>
+
+typedef void *(*z_alloc_func)(void *opaque, size_t items, size_t size);
+typedef void (*z_free_func)(void *opaque, void *address);
+
+/*	Route every allocation made by the library (deflate, inflate, lzss and
+	huffman_coding) through ZALLOC and ZFREE, passing OPAQUE back on each call.
+	ZALLOC returns NULL on failure and need not zero the memory it hands out.
+	Passing NULL for either hook restores the default calloc/free pair.
+	Install the hooks before starting any codec; they are process-wide.  */
+void z_set_allocator(z_alloc_func zalloc, z_free_func zfree, void *opaque);
+
+#endif  // _ZALLOC_H
@@ -12,6 +12,9 @@
 #define INVALID_MATCH_LEN (-8)
 #define ADLER_CHECKSUM_ERR (-9)
 #define FILE_ERROR (-10)
+#define INVALID_CHUNK_INDEX (-11)
+#define CORRUPT_CHUNK (-12)
+#define INVALID_PARSE (-13)
 #define UNDEFINED_ERROR (-99)
 
 inline const char *z_strerr(int code)
@@ -40,6 +43,12 @@ inline const char *z_strerr(int code)
         return "Deflated data checksum does not match stored checksum";
     case FILE_ERROR:
         return "File I/O error";
+    case INVALID_CHUNK_INDEX:
+        return "Missing chunk index or chunk out of range";
+    case CORRUPT_CHUNK:
+        return "Corrupt chunk data";
+    case INVALID_PARSE:
+        return "Malformed deflate parse";
     default:
         return "Unknown error";
     }
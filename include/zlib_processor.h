@@ -8,9 +8,15 @@
  * zlib/inflate.c
  * zlib/lzssutils.c
  * zlib/zutils.c
+ * zlib/zmem.c
+ * zlib/zio.c
+ * zlib/zhist.c
+ * zlib/zprobe.c
+ * zlib/zmatch.c
 */
 
 #include "zerrcodes.h"
+#include "zalloc.h"
 #include "inflate.h"
 #include "deflate.h"
 
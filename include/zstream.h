@@ -0,0 +1,39 @@
+#ifndef _ZSTREAM_H
+#define _ZSTREAM_H 1
+
+#include <stddef.h>
+
+/*	Byte sources and sinks for the *_stream entry points. Every callback gets
+	the OPAQUE pointer of its structure as first argument.  */
+
+typedef struct z_iovec {
+	const unsigned char *base;
+	size_t len;
+} z_iovec;
+
+typedef struct z_source {
+	void *opaque;
+
+	/*	Read up to LEN bytes into BUF. Returns the number of bytes read,
+		0 once the input is exhausted, or a negative value on error. Short
+		reads are fine.  */
+	long (*read)(void *opaque, unsigned char *buf, size_t len);
+
+	/*	Optional (may be NULL). Expose all remaining input as one read-only
+		span, valid until the codec returns, so it can be processed in place
+		instead of being copied through READ. Returns NULL to decline.  */
+	const unsigned char *(*view)(void *opaque, size_t *len);
+} z_source;
+
+typedef struct z_sink {
+	void *opaque;
+
+	/*	Consume all LEN bytes of BUF. Returns 0 on success.  */
+	int (*write)(void *opaque, const unsigned char *buf, size_t len);
+
+	/*	Optional (may be NULL). Consume IOVCNT buffers in order, in one go.
+		Returns 0 on success. Without it, WRITE is called once per buffer.  */
+	int (*writev)(void *opaque, const z_iovec *iov, int iovcnt);
+} z_sink;
+
+#endif  // _ZSTREAM_H
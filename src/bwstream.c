@@ -3,18 +3,18 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include "zmem.h"
 
 bw_stream_t *bws_create(int mode)
 {
-	bw_stream_t *bws = (bw_stream_t *)calloc(1, sizeof(bw_stream_t));
-	assert(bws);
+	bw_stream_t *bws = (bw_stream_t *)z_calloc(1, sizeof(bw_stream_t));
 	bws->mode = mode;
 	return bws;
 }
 
 void bws_destroy(bw_stream_t *bws)
 {
-	free(bws);
+	z_free(bws);
 }
 
 unsigned char *bws_assign_stream(bw_stream_t *bws, unsigned char *stream,
@@ -2,6 +2,8 @@
 #define _BWSTREAM_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #define BW_M_READ 0x1
 #define BW_M_WRITE 0x2
@@ -61,4 +63,65 @@ int bws_write_lsbf(bw_stream_t *bws, int data, int nbits);
 	Upon failure, successive calls are allowed on the same buffer.  */
 int bws_write_msbf(bw_stream_t *bws, int data, int nbits);
 
+/*	Word-at-a-time LSB-first writer. Bits gather in BITBUF and are stored to
+	OUT eight bytes at a time, of which only the complete ones are kept, so
+	the buffer behind OUT needs BW_SLACK writable bytes past the last byte
+	the caller lets it reach. Nothing has to be zeroed beforehand.  */
+#define BW_SLACK 8
+#define BW_MAX_PUT 56		// most bits a single bww_put takes
+
+typedef struct bw_writer_t {
+	uint64_t bitbuf;
+	unsigned bitcnt;
+	unsigned char *out;
+} bw_writer_t;
+
+static inline void bww_init(bw_writer_t *bw, unsigned char *out)
+{
+	bw->bitbuf = 0;
+	bw->bitcnt = 0;
+	bw->out = out;
+}
+
+/*	Store the complete bytes of the bit buffer, at most 7 bits stay behind.
+	BITCNT may be 64 here, right after bww_align.  */
+static inline void bww_flush(bw_writer_t *bw)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(bw->out, &bw->bitbuf, sizeof(bw->bitbuf));
+#else
+	for (unsigned i = 0; i < 8; i++)
+		bw->out[i] = (unsigned char)(bw->bitbuf >> (8 * i));
+#endif
+	unsigned bytes = bw->bitcnt >> 3;
+
+	bw->out += bytes;
+	bw->bitbuf = bytes == 8 ? 0 : bw->bitbuf >> (8 * bytes);
+	bw->bitcnt &= 7;
+}
+
+/*	Append the NBITS low bits of BITS (nothing may be set above them), first
+	bit least significant. NBITS is at most BW_MAX_PUT.  */
+static inline void bww_put(bw_writer_t *bw, uint64_t bits, unsigned nbits)
+{
+	if (bw->bitcnt + nbits > 63)
+		bww_flush(bw);
+	bw->bitbuf |= bits << bw->bitcnt;
+	bw->bitcnt += nbits;
+}
+
+/*	Pad to a byte boundary with zero bits.  */
+static inline void bww_align(bw_writer_t *bw)
+{
+	bw->bitcnt = (bw->bitcnt + 7) & ~7u;
+}
+
+/*	Store everything, padding the last byte. The writer ends byte aligned
+	and empty.  */
+static inline void bww_finish(bw_writer_t *bw)
+{
+	bww_align(bw);
+	bww_flush(bw);
+}
+
 #endif  // _BWSTREAM_H
@@ -3,8 +3,17 @@
 #include <string.h>
 #include <stdio.h>
 #include "zutils.h"
+#include "zhist.h"
 
 #define MAX_MARKS 256
+#define FAST_MARKS 16			// chain walk of blocks the probe calls fast
+#define STORED_MAX 65535		// longest stored block
+#define PARSE_TAG "DPAR"			// serialized deflate_parse_t
+#define PARSE_HEADER_LEN 24
+#define PARSE_IO_TOKENS 1024		// tokens converted per read or write
+#define SPLIT_TOKENS 4096			// piece a split block grows by
+#define QUICK_HASH_LOG 15			// single-probe table of DEFLATE_F_FAST
+#define QUICK_SKIP_LOG 5			// misses before the literal step grows
 
 static inline __attribute__((__always_inline__)) int f_log2(int x)
 {
@@ -26,44 +35,167 @@ static inline __attribute__((__always_inline__)) int f_log2(int x)
 
 #define _MIN(a, b) ((a) < (b) ? (a) : (b))
 
+static inline uint32_t load32(const z_byte *p)
+{
+	uint32_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static inline uint32_t quick_hash(uint32_t word)
+{
+	return (word * 2654435761u) >> (32 - QUICK_HASH_LOG);
+}
+
+/* Block tokens: a literal is its byte. A match packs its length symbol
+(257 to 285) in the low 9 bits, then the length extra bits (5), the
+distance code (5) and the distance extra bits (13) */
+
+#define TOK_MATCH(len_code, len_extra, dist_code, dist_extra)\
+	((uint32_t)(len_code) | (uint32_t)(len_extra) << 9 |\
+	(uint32_t)(dist_code) << 14 | (uint32_t)(dist_extra) << 19)
+#define TOK_SYM(tok) ((int)((tok) & 0x1ff))
+#define TOK_LEN_EXTRA(tok) ((tok) >> 9 & 0x1f)
+#define TOK_DIST_CODE(tok) ((int)((tok) >> 14 & 0x1f))
+#define TOK_DIST_EXTRA(tok) ((tok) >> 19)
+
 static int deflate_block(z_stream_t *strm);
 
-static huffman_tuple *gen_clen_codes();
+/* Parse the block in IN into SEQ, counting the symbols to code in LIT_FREQ
+and DIST_FREQ. Returns the number of bytes covered, past AVAIL_IN when the
+last match runs into the next block */
+
+static int parse_block(z_stream_t *strm, int *lit_freq, int *dist_freq);
+
+/* Same as parse_block for DEFLATE_F_FAST: one candidate per hash, literal
+runs crossed in growing steps and only a couple of positions inside each
+match hashed */
+
+static int quick_block(z_stream_t *strm, int *lit_freq, int *dist_freq);
+
+/* Code the N tokens of SEQ as a block of type BTYPE, with tables built from
+LIT_FREQ and DIST_FREQ */
+
+static int write_block(z_stream_t *strm, const uint32_t *seq, size_t n,
+	int *lit_freq, int *dist_freq, int btype, int is_last);
+
+static huffman_tuple *gen_clen_codes(z_arena_t *arena, int *clen_freq,
+	int *clen_clens);
+
+static const int clen_order[MAX_ALPHABET_CODES] =
+	{16, 17, 18, 0, 8, 7,
+	9, 6, 10, 5, 11, 4,
+	12, 3, 13, 2, 14, 1, 15};
 
 static int __fetch_data(z_stream_t *strm);
 
 static int __dump_output(z_stream_t *strm);
 
-static int safe_write_lsbf(z_stream_t *strm, int data, int nbits);
-
-static int safe_write_msbf(z_stream_t *strm, int data, int nbits);
+static int __flush_output(z_stream_t *strm);
 
-static int safe_write_byte(z_stream_t *strm, z_byte byte);
+static int __put_bits(z_stream_t *strm, uint64_t bits, int nbits);
 
 static int write_int_be(z_stream_t *strm, int val);
 
 static int get_successive_val_count(int *arr, int idx, int n);
 
+static int deflate_stored(z_stream_t *strm, int is_last);
+
+static int deflate_io(z_io_t *io, int flags);
+
+static int parse_io(z_io_t *io, deflate_parse_t *parse);
+
+static int emit_io(const deflate_parse_t *parse, int strategy, z_io_t *io);
+
+static void parse_reserve(deflate_parse_t *parse, size_t n);
+
+/* Bytes TOK stands for and, for a match, its distance in *DIST. Returns 0
+for a malformed token */
+
+static int token_bytes(uint32_t tok, int *dist);
+
+/* Z_OK if every token is well formed, reaches back no further than the
+start and they add up to SIZE */
+
+static int check_parse(const deflate_parse_t *parse);
+
+/* Count the symbols and the bytes of tokens START to END */
+
+static void count_tokens(const deflate_parse_t *parse, size_t start,
+	size_t end, int *lit_freq, int *dist_freq, uint64_t *bytes);
+
+/* The block from token START on, cut as deflate does or where the
+statistics change. Counts its symbols and bytes, returns its end */
+
+static size_t cut_block(const deflate_parse_t *parse, size_t start,
+	int *lit_freq, int *dist_freq, uint64_t *bytes);
+
+static size_t split_block(const deflate_parse_t *parse, size_t start,
+	int *lit_freq, int *dist_freq, uint64_t *bytes);
+
+/* Estimated size in bits of a block with these symbols, extra bits left
+out */
+
+static uint64_t fixed_cost(const int *lit_freq, const int *dist_freq);
+
+static uint64_t dyn_cost(const int *lit_freq, const int *dist_freq);
+
+static uint64_t block_cost(const int *lit_freq, const int *dist_freq);
+
+static void put_le(unsigned char *p, uint64_t val, int n);
+
+static uint64_t get_le(const unsigned char *p, int n);
+
 int deflate(FILE *src, FILE *dest)
+{
+	return deflate_flags(src, dest, 0);
+}
+
+int deflate_stream(const z_source *src, const z_sink *dest)
+{
+	return deflate_stream_flags(src, dest, 0);
+}
+
+int deflate_flags(FILE *src, FILE *dest, int flags)
+{
+	z_io_t io;
+	zio_init_file(&io, src, dest);
+
+	return deflate_io(&io, flags);
+}
+
+int deflate_stream_flags(const z_source *src, const z_sink *dest, int flags)
+{
+	z_io_t io;
+	zio_init(&io, src, dest);
+
+	return deflate_io(&io, flags);
+}
+
+static int deflate_io(z_io_t *io, int flags)
 {
 	/* Init stream and LUTs */
 
 	z_stream_t strm;
-	zlib_init(&strm, src, dest, Z_MODE_DEFLATE);
+	zlib_init(&strm, io, Z_MODE_DEFLATE);
 	luts_init();
+	strm.flags = flags;
 
-	/* Assign output stream to bitwise processor */
-
-	bws_assign_stream(strm.bws, strm.out, CHUNK_SIZE);
+	/* Write zlib header (default or fastest compression, 32K window size,
+	no dict) */
 
-	/* Write zlib header (default compression, 32K window size, no dict) */
-
-	(void)bws_write_lsbf(strm.bws, 0x78, 8);
-	(void)bws_write_lsbf(strm.bws, 0x9C, 8);
+	if (flags & DEFLATE_F_FAST) {
+		strm.quick_head = (uint32_t *)z_calloc((size_t)1 << QUICK_HASH_LOG,
+			sizeof(uint32_t));
+		bww_put(&strm.bw, 0x0178, 16);
+	} else {
+		bww_put(&strm.bw, 0x9C78, 16);
+	}
 
-	/* Init sliding window */
+	/* Mapped input: reserve about as much output space up front */
 
-	strm.sliding_window = cb_create(32768);		/* 32K */
+	if (strm.io->map)
+		zio_reserve(strm.io, strm.io->map_len + (strm.io->map_len >> 6) + 64);
 
 	/* Process all input */
 
@@ -95,130 +227,274 @@ int deflate(FILE *src, FILE *dest)
 
 	/* Dump remaining output */
 
-	if (BW_USED_BYTES(strm.bws) != 0) {
-		__dump_output(&strm);
-	}
+	bww_finish(&strm.bw);
+	res = __dump_output(&strm);
 
 	zlib_destroy(&strm);
-	return Z_OK;
+	return res;
 }
 
-static void rm_oldest_pos(z_stream_t *strm);
+void deflate_parse_init(deflate_parse_t *parse)
+{
+	parse->tokens = NULL;
+	parse->count = 0;
+	parse->capacity = 0;
+	parse->size = 0;
+	parse->adler = 1;
+}
 
-static void mark_curr_pos(z_stream_t *strm, int pos)
+void deflate_parse_free(deflate_parse_t *parse)
 {
-	int removed = 0;
-	int ht_idx = 0;
-	if (pos <= strm->avail_in - 2) {
-		z_byte c1 = strm->in[pos];
-		z_byte c2 = strm->in[pos + 1];
-		ht_idx = (c1 << 8) + c2;
-		lzl_push_front(&strm->hashtable[ht_idx], strm->total_out);
+	z_free(parse->tokens);
+	deflate_parse_init(parse);
+}
 
-		if ((&strm->hashtable[ht_idx])->size > MAX_MARKS) {
-			(void)lzl_pop_back(&strm->hashtable[ht_idx]);
-			removed = 1;
-		}
+uint32_t deflate_token(int len, int dist)
+{
+	luts_init();
+
+	int len_code = _GET_LEN_CODE(len);
+	int dist_code = _GET_DIST_CODE(dist);
+
+	return TOK_MATCH(len_code, len - LEN_BASE_VAL(len_code), dist_code,
+		dist - DIST_BASE_VAL(dist_code));
+}
+
+void deflate_parse_push(deflate_parse_t *parse, uint32_t tok)
+{
+	int dist;
+
+	luts_init();
+	parse_reserve(parse, 1);
+	parse->tokens[parse->count++] = tok;
+	parse->size += (uint64_t)token_bytes(tok, &dist);
+}
+
+int deflate_parse(FILE *src, deflate_parse_t *parse)
+{
+	z_io_t io;
+	zio_init_file(&io, src, NULL);
+
+	return parse_io(&io, parse);
+}
+
+int deflate_parse_stream(const z_source *src, deflate_parse_t *parse)
+{
+	z_io_t io;
+	zio_init(&io, src, NULL);
+
+	return parse_io(&io, parse);
+}
+
+int deflate_emit(const deflate_parse_t *parse, int strategy, FILE *dest)
+{
+	z_io_t io;
+	zio_init_file(&io, NULL, dest);
+
+	return emit_io(parse, strategy, &io);
+}
+
+int deflate_emit_stream(const deflate_parse_t *parse, int strategy,
+	const z_sink *dest)
+{
+	z_io_t io;
+	zio_init(&io, NULL, dest);
+
+	return emit_io(parse, strategy, &io);
+}
+
+int deflate_parse_save(const deflate_parse_t *parse, FILE *dest)
+{
+	unsigned char buf[PARSE_IO_TOKENS * 4];
+
+	memcpy(buf, PARSE_TAG, 4);
+	put_le(buf + 4, parse->size, 8);
+	put_le(buf + 12, parse->adler, 4);
+	put_le(buf + 16, parse->count, 8);
+
+	if (fwrite(buf, 1, PARSE_HEADER_LEN, dest) != PARSE_HEADER_LEN)
+		return FILE_ERROR;
+
+	for (size_t i = 0; i < parse->count; i += PARSE_IO_TOKENS) {
+		size_t n = _MIN(parse->count - i, PARSE_IO_TOKENS);
+
+		for (size_t j = 0; j < n; j++)
+			put_le(buf + 4 * j, parse->tokens[i + j], 4);
+
+		if (fwrite(buf, 4, n, dest) != n)
+			return FILE_ERROR;
 	}
-	z_byte c1 = cb_get(strm->sliding_window, 0);
-	z_byte c2 = cb_get(strm->sliding_window, 1);
 
-	if (ht_idx != (c1 << 8) + c2 || removed == 0)
-		rm_oldest_pos(strm);
+	return Z_OK;
 }
 
-static void rm_oldest_pos(z_stream_t *strm)
+int deflate_parse_load(deflate_parse_t *parse, FILE *src)
 {
-	if (cb_is_full(strm->sliding_window)) {
-		z_byte c1 = cb_get(strm->sliding_window, 0);
-		z_byte c2 = cb_get(strm->sliding_window, 1);
-		
-		int ht_idx = (c1 << 8) + c2;
-		(void)lzl_pop_back(&strm->hashtable[ht_idx]);
+	unsigned char buf[PARSE_IO_TOKENS * 4];
+
+	deflate_parse_init(parse);
+
+	if (fread(buf, 1, PARSE_HEADER_LEN, src) != PARSE_HEADER_LEN)
+		return FILE_ERROR;
+	if (memcmp(buf, PARSE_TAG, 4) != 0)
+		return INVALID_PARSE;
+
+	uint64_t size = get_le(buf + 4, 8);
+	uint32_t adler = (uint32_t)get_le(buf + 12, 4);
+	uint64_t count = get_le(buf + 16, 8);
+
+	/* Every token stands for a byte at least. The tokens are read a batch
+	at a time, a bogus count runs into the end of the file rather than
+	into a huge allocation */
+
+	if (count > size)
+		return INVALID_PARSE;
+
+	while (parse->count < count) {
+		size_t n = (size_t)_MIN(count - parse->count, PARSE_IO_TOKENS);
+
+		if (fread(buf, 4, n, src) != n) {
+			deflate_parse_free(parse);
+			return FILE_ERROR;
+		}
+
+		parse_reserve(parse, n);
+		for (size_t j = 0; j < n; j++)
+			parse->tokens[parse->count++] = (uint32_t)get_le(buf + 4 * j, 4);
 	}
+
+	parse->size = size;
+	parse->adler = adler;
+
+	return Z_OK;
 }
 
-static int find_match(z_stream_t *strm, int pos, int *len, int *dist)
+static int parse_io(z_io_t *io, deflate_parse_t *parse)
 {
-	int max_len = 2;
+	z_stream_t strm;
+	zlib_init(&strm, io, Z_MODE_DEFLATE);
+	luts_init();
+	deflate_parse_init(parse);
 
-	*len = 0;
-	*dist = 0;
+	/* The blocks deflate would code, parsed the same way and kept */
 
-	circ_buff_t *win = strm->sliding_window;
+	strm.finder.params.depth = MAX_MARKS;
 
-	if (pos < strm->avail_in - 2) {
-		/* Look for matches only if there are enough bytes in input buffer */
+	int err = Z_OK;
 
-		z_byte c1 = strm->in[pos];
-		z_byte c2 = strm->in[pos + 1];
+	while (strm.eof == 0) {
+		strm.seq_len = 0;
 
-		int ht_idx = (c1 << 8) + c2;
-		lz_list_t *list = &strm->hashtable[ht_idx];
-		int mark_no = 0;
+		err = __fetch_data(&strm);
 
-		for (lz_node_t *node = list->head; node; node = node->next) {
-			/* Localize potential match */
+		if (err != Z_OK)
+			break;
 
-			int global_pos = node->data;
-			int distance = strm->total_out - global_pos;
-			int i = 0;
+		int lit_freq[MAX_LITLEN_CODES] = {0};
+		int dist_freq[MAX_DIST_CODES] = {0};
 
-			/* Calculate satisfactory length heuristic */
+		int block_end = parse_block(&strm, lit_freq, dist_freq);
 
-			int heuristic = mark_no - MAX_MARKS;	// Assume MAX_MARKS == 256
-			heuristic *= heuristic * 7;
-			heuristic >>= 11;
-			heuristic += 32;
+		parse_reserve(parse, (size_t)strm.seq_len);
+		memcpy(parse->tokens + parse->count, strm.seq,
+			(size_t)strm.seq_len * sizeof(uint32_t));
+		parse->count += (size_t)strm.seq_len;
+		parse->size += (uint64_t)block_end;
 
-			/* Calculate match length */
+		update_adler(&strm.adler, strm.in, block_end);
 
-			while (i < strm->avail_in - pos) {
-				/* indexing in sliding window is done with dist - 1 */
+		if (strm.io->map)
+			strm.in_pos += (size_t)block_end;
+	}
 
-				z_byte next_in_stream = strm->in[pos + i];
-				int win_idx = distance - 1 - i;
-				z_byte next_in_win;
+	parse->adler = strm.adler;
 
-				if (win_idx >= 0) {
-					next_in_win = cb_get_from_back(win, win_idx);
-				} else {
-					next_in_win = strm->in[pos - win_idx - 1];
-				}
+	zlib_destroy(&strm);
 
-				if (next_in_stream != next_in_win)
-					break;
+	if (err != Z_OK)
+		deflate_parse_free(parse);
 
-				if (i + 1 > max_len) {
-					max_len = i + 1;
-					*len = i + 1;
-					*dist = distance;
-				}
-				if (*len == 258) {
-					return 1;
-				}
-				i++;
-			}
-			if (*len >= heuristic) {
-				return 1;
-			}
-			mark_no++;
-		}
-		if (*len >= 4) {
-			return 1;
+	return err;
+}
+
+static int emit_io(const deflate_parse_t *parse, int strategy, z_io_t *io)
+{
+	luts_init();
+
+	int err = check_parse(parse);
+
+	if (err != Z_OK)
+		return err;
+
+	z_stream_t strm;
+	zlib_init(&strm, io, Z_MODE_DEFLATE);
+
+	bww_put(&strm.bw, 0x9C78, 16);
+
+	/* Blocks of DEFLATE_EMIT_FIXED and DEFLATE_EMIT_DYNAMIC end where
+	deflate's would, the last one is the one starting CHUNK_SIZE bytes or
+	less from the end, even if empty */
+
+	size_t start = 0;
+	uint64_t done = 0;
+	int is_last;
+
+	do {
+		za_reset(strm.arena);
+
+		int lit_freq[MAX_LITLEN_CODES] = {0};
+		lit_freq[256] = 1;
+
+		int dist_freq[MAX_DIST_CODES] = {0};
+
+		uint64_t bytes = 0;
+		size_t end;
+		int btype;
+
+		if (strategy == DEFLATE_EMIT_SPLIT) {
+			end = split_block(parse, start, lit_freq, dist_freq, &bytes);
+			is_last = end == parse->count;
+			btype = (fixed_cost(lit_freq, dist_freq) <=
+				dyn_cost(lit_freq, dist_freq)) ?
+				DEFLATE_BTYPE_FIX : DEFLATE_BTYPE_DYN;
+		} else {
+			end = cut_block(parse, start, lit_freq, dist_freq, &bytes);
+			is_last = parse->size - done <= CHUNK_SIZE;
+			btype = (strategy == DEFLATE_EMIT_DYNAMIC &&
+				bytes > Z_DYN_TRESHOLD) ?
+				DEFLATE_BTYPE_DYN : DEFLATE_BTYPE_FIX;
 		}
-	} else {
-		return 0;
+
+		err = write_block(&strm, parse->tokens + start, end - start,
+			lit_freq, dist_freq, btype, is_last);
+
+		if (err == Z_OK)
+			err = __flush_output(&strm);
+		if (err != Z_OK)
+			break;
+
+		start = end;
+		done += bytes;
+	} while (!is_last);
+
+	if (err == Z_OK)
+		err = write_int_be(&strm, (int)parse->adler);
+
+	if (err == Z_OK) {
+		bww_finish(&strm.bw);
+		err = __dump_output(&strm);
 	}
 
-	return 0;
+	zlib_destroy(&strm);
+	return err;
 }
 
 static int deflate_block(z_stream_t *strm)
 {
-	/* Clear history of back-pointers */
+	/* Clear last block's tokens and tables */
 
-	bl_arr_reset(strm->bl_arr);
+	strm->seq_len = 0;
+	za_reset(strm->arena);
 
 	/* Fetch block of input data */
 
@@ -227,73 +503,195 @@ static int deflate_block(z_stream_t *strm)
 	if (err != Z_OK)
 		return err;
 
-	/* Construct and write deflate block header */
-
 	int is_last = strm->eof;
+
+	/* Let the probe choose between storing and a short or full search */
+
+	strm->finder.params.depth = MAX_MARKS;
+	if (strm->flags & DEFLATE_F_PROBE) {
+		int advice = deflate_probe(strm->in, (size_t)strm->avail_in);
+
+		if (advice == DEFLATE_PROBE_STORE)
+			return deflate_stored(strm, is_last);
+		if (advice == DEFLATE_PROBE_FAST)
+			strm->finder.params.depth = FAST_MARKS;
+	}
+
 	int btype = (strm->avail_in > Z_DYN_TRESHOLD) ? 
 		DEFLATE_BTYPE_DYN : DEFLATE_BTYPE_FIX;
 
-	int header = (is_last & 1) | ((btype & BTYPE_MASK) << BTYPE_OFFSET);
+	int lit_freq[MAX_LITLEN_CODES] = {0};
+	lit_freq[256] = 1;
+
+	int dist_freq[MAX_DIST_CODES] = {0};
+
+	int block_end;
 
-	err = safe_write_lsbf(strm, header, DEFLATE_HEADER_SIZE);
+	if (strm->flags & DEFLATE_F_FAST) {
+		/* Dynamic tables only when they are estimated to pay off */
+
+		block_end = quick_block(strm, lit_freq, dist_freq);
+		if (fixed_cost(lit_freq, dist_freq) <= dyn_cost(lit_freq, dist_freq))
+			btype = DEFLATE_BTYPE_FIX;
+	} else {
+		block_end = parse_block(strm, lit_freq, dist_freq);
+	}
+
+	err = write_block(strm, strm->seq, (size_t)strm->seq_len, lit_freq,
+		dist_freq, btype, is_last);
 
 	if (err != Z_OK)
 		return err;
 
-	int pos = 0;
+	update_adler(&strm->adler, strm->in, block_end);
 
-	int lit_freq[MAX_LITLEN_CODES] = {0};
-	lit_freq[256] = 1;
+	if (strm->io->map)
+		strm->in_pos += (size_t)block_end;
 
-	int dist_freq[MAX_DIST_CODES] = {0};
+	/* Hand the finished block to the sink right away */
 
-	// find match;
-	// if match found
-	//		store match
-	//		for 0 <= i < len
-	//			mark entry in ht
-	//			push char to sliding window
-	//			advance pos and total_out
-	// else
-	//		mark entry in ht
-	//		push char to window
-	//		advance pos and total_out
+	return __flush_output(strm);
+}
+
+static int parse_block(z_stream_t *strm, int *lit_freq, int *dist_freq)
+{
+	int pos = 0;
+
+	/* Literals are counted a run at a time, from LIT_START up to the next
+	match or the end of the block */
+
+	int lit_start = 0;
 
 	while (pos < strm->avail_in) {
-		int dist = 0, len = 0;
-		if (find_match(strm, pos, &len, &dist)) {
-			/* Add duplicate to back-link array */
+		/* Matches may run past AVAIL_IN when the input is mapped */
+
+		z_byte *scan = strm->in + pos;
+		size_t ahead = (size_t)(strm->lookahead - pos);
+		uint32_t match_dist = 0;
+		int len = (int)zm_find(&strm->finder, scan, ahead,
+			(size_t)strm->total_out, (uint32_t)strm->total_out, &match_dist);
+		int dist = (int)match_dist;
+
+		if (len) {
+			/* Code the match right away, the emit pass only packs bits */
+
+			zh_count(strm->in + lit_start, (size_t)(pos - lit_start),
+				lit_freq);
+
+			int len_code = _GET_LEN_CODE(len);
+			int dist_code = _GET_DIST_CODE(dist);
+
+			strm->seq[strm->seq_len++] = TOK_MATCH(len_code,
+				len - LEN_BASE_VAL(len_code), dist_code,
+				dist - DIST_BASE_VAL(dist_code));
+			lit_freq[len_code]++;
+			dist_freq[dist_code]++;
+			lit_start = pos + len;
+		} else {
+			strm->seq[strm->seq_len++] = *scan;
+			len = 1;
+		}
 
-			bl_arr_push(strm->bl_arr, pos, dist, len);
+		/* Slide the bytes covered into the window */
 
-			lit_freq[_GET_LEN_CODE(len)]++;
-			dist_freq[_GET_DIST_CODE(dist)]++;
+		zm_insert(&strm->finder, scan, (size_t)len, ahead,
+			(uint32_t)strm->total_out);
+		pos += len;
+		strm->total_out += (uint64_t)len;
+	}
+
+	zh_count(strm->in + lit_start, (size_t)(pos - lit_start), lit_freq);
 
-			for (int i = 0; i < len; i++) {
-				/* Push LEN bytes to sliding_window */
+	return pos;
+}
 
-				mark_curr_pos(strm, pos);
-				cb_push(strm->sliding_window, strm->in[pos]);
-				pos++;
-				strm->total_out++;
+static int quick_block(z_stream_t *strm, int *lit_freq, int *dist_freq)
+{
+	uint32_t *head = strm->quick_head;
+	uint32_t base = (uint32_t)strm->total_out;
+	int end = strm->avail_in;
+	int pos = 0, lit_start = 0, misses = 0;
+
+	/* Probing needs Z_MIN_MATCH bytes, the last few are literals anyway */
+
+	while (pos < end && strm->lookahead - pos >= Z_MIN_MATCH) {
+		z_byte *scan = strm->in + pos;
+		uint32_t word = load32(scan);
+		uint32_t h = quick_hash(word);
+		uint32_t at = base + (uint32_t)pos;
+		uint32_t cand = head[h];
+		uint32_t dist = at + 1 - cand;
+
+		head[h] = at + 1;
+
+		if (cand && dist <= Z_WSIZE && load32(scan - dist) == word) {
+			int ahead = strm->lookahead - pos;
+			int limit = _MIN(ahead, Z_MAX_MATCH);
+			int len = Z_MIN_MATCH + (int)zm_match_len(scan + Z_MIN_MATCH,
+				scan - dist + Z_MIN_MATCH, (uint32_t)(limit - Z_MIN_MATCH));
+
+			zh_count(strm->in + lit_start, (size_t)(pos - lit_start),
+				lit_freq);
+
+			int len_code = _GET_LEN_CODE(len);
+			int dist_code = _GET_DIST_CODE((int)dist);
+
+			strm->seq[strm->seq_len++] = TOK_MATCH(len_code,
+				len - LEN_BASE_VAL(len_code), dist_code,
+				(int)dist - DIST_BASE_VAL(dist_code));
+			lit_freq[len_code]++;
+			dist_freq[dist_code]++;
+
+			/* Hash the second and the next to last position of the
+			match, enough to pick up repeats of it */
+
+			if (len + 2 <= ahead) {
+				head[quick_hash(load32(scan + 1))] = at + 2;
+				head[quick_hash(load32(scan + len - 2))] =
+					at + (uint32_t)len - 1;
 			}
-		} else {
-			/* Push one byte to sliding window */
 
-			mark_curr_pos(strm, pos);
-			cb_push(strm->sliding_window, strm->in[pos]);
+			pos += len;
+			lit_start = pos;
+			misses = 0;
+		} else {
+			/* The longer nothing is found, the more bytes go by as
+			literals before the next probe */
 
-			lit_freq[strm->in[pos]]++;
+			int step = _MIN(1 + (misses++ >> QUICK_SKIP_LOG), end - pos);
 
-			pos++;
-			strm->total_out++;
+			for (int i = 0; i < step; i++)
+				strm->seq[strm->seq_len++] = scan[i];
+			pos += step;
 		}
 	}
 
+	while (pos < end)
+		strm->seq[strm->seq_len++] = strm->in[pos++];
+
+	zh_count(strm->in + lit_start, (size_t)(pos - lit_start), lit_freq);
+
+	strm->total_out += (uint64_t)pos;
+
+	return pos;
+}
+
+static int write_block(z_stream_t *strm, const uint32_t *seq, size_t n,
+	int *lit_freq, int *dist_freq, int btype, int is_last)
+{
+	/* Construct and write deflate block header */
+
+	int header = (is_last & 1) | ((btype & BTYPE_MASK) << BTYPE_OFFSET);
+
+	int err = __put_bits(strm, (uint64_t)header, DEFLATE_HEADER_SIZE);
+
+	if (err != Z_OK)
+		return err;
+
 	huffman_tuple *lit_table = NULL;
 	huffman_tuple *dist_table = NULL;
 
-	if (btype == DEFLATE_BTYPE_DYN || btype == DEFLATE_BTYPE_FIX) {
+	if (btype == DEFLATE_BTYPE_DYN) {
 		/* Calculate literal code count and distance code count */
 
 		int lit_cnt = 0;
@@ -317,8 +715,8 @@ static int deflate_block(z_stream_t *strm)
 		hm_get_codelengths(lit_freq, lit_clens, lit_cnt, 15);
 		hm_get_codelengths(dist_freq, dist_clens, dist_cnt, 15);
 
-		lit_table = hm_create_table(lit_clens, lit_cnt);
-		dist_table = hm_create_table(dist_clens, dist_cnt);
+		lit_table = hm_create_table(strm->arena, lit_clens, lit_cnt);
+		dist_table = hm_create_table(strm->arena, dist_clens, dist_cnt);
 
 		/* Merge codelengths into a single alphabet */
 
@@ -373,14 +771,16 @@ static int deflate_block(z_stream_t *strm)
 			}
 		}
 
-		// int order[MAX_ALPHABET_CODES] = 
-		// 	{16, 17, 18, 0, 8, 7,
-		// 	9, 6, 10, 5, 11, 4,
-		// 	12, 3, 13, 2, 14, 1, 15};
+		/* Huffman code the run-length alphabet and drop the trailing unused
+		codes in transmission order */
 
-		int clen_cnt = 19;
+		int clen_clens[MAX_ALPHABET_CODES] = {0};
+		huffman_tuple *clen_table = gen_clen_codes(strm->arena, clen_freq,
+			clen_clens);
 
-		huffman_tuple *clen_table = gen_clen_codes();
+		int clen_cnt = MAX_ALPHABET_CODES;
+		while (clen_cnt > 4 && clen_clens[clen_order[clen_cnt - 1]] == 0)
+			clen_cnt--;
 
 		int hlit = lit_cnt - 257;
 		int hdist = dist_cnt - 1;
@@ -388,56 +788,40 @@ static int deflate_block(z_stream_t *strm)
 
 		/* Write HLIT, HDIST and HCLEN */
 
-		if ((err = safe_write_lsbf(strm, hlit, HLIT_BITS) != Z_OK))
-			return err;
-		if ((err = safe_write_lsbf(strm, hdist, HDIST_BITS) != Z_OK))
-			return err;
-		if ((err = safe_write_lsbf(strm, hclen, HCLEN_BITS) != Z_OK))
+		uint64_t counts = (uint64_t)hlit | (uint64_t)hdist << HLIT_BITS |
+			(uint64_t)hclen << (HLIT_BITS + HDIST_BITS);
+
+		err = __put_bits(strm, counts, HLIT_BITS + HDIST_BITS + HCLEN_BITS);
+		if (err != Z_OK)
 			return err;
 
 		/* Write codelengths for run-length encoded alphabet */
 
 		for (int i = 0; i < clen_cnt; i++) {
-			if (i < 3) {
-				if ((err = safe_write_lsbf(strm, 3, 3)) != Z_OK)
-					return err;
-			} else if (i < 7) {
-				if ((err = safe_write_lsbf(strm, 4, 3)) != Z_OK)
-					return err;
-			} else {
-				if ((err = safe_write_lsbf(strm, 5, 3)) != Z_OK)
-					return err;
-			}
+			err = __put_bits(strm, (uint64_t)clen_clens[clen_order[i]], 3);
+			if (err != Z_OK)
+				return err;
 		}
 
 		/* Write run-length encoded codelengths for merged alphabets */
 		
 		for (int i = 0; i < p2; i++) {
-			/* Write next codelength */
-			err = safe_write_msbf(strm, clen_table[run_len_enc_clens[i]].code,
-				clen_table[run_len_enc_clens[i]].len);
+			/* Write next codelength, with its extra bits in the same put */
 
-			if (err != Z_OK) {
-				free(clen_table);
-				return err;
-			}
+			huffman_tuple *code = &clen_table[run_len_enc_clens[i]];
+			uint64_t bits = code->rcode;
+			int nbits = code->len;
 
 			if (run_len_enc_clens[i] >= 16) {
-				/* Write extra bits */
-
-				int nbits = run_len_enc_clens[i] == 16 ? 2 :
-					run_len_enc_clens[i] == 17 ? 3 : 7;
+				bits |= (uint64_t)extra_bits[i] << nbits;
+				nbits += CLEN_EXTRA_BITS(run_len_enc_clens[i]);
+			}
 
-				err = safe_write_lsbf(strm, extra_bits[i], nbits);
+			err = __put_bits(strm, bits, nbits);
 
-				if (err != Z_OK) {
-					free(clen_table);
-					return err;
-				}
-			}
+			if (err != Z_OK)
+				return err;
 		}
-
-		free(clen_table);
 	} else if (btype == DEFLATE_BTYPE_FIX) {
 		/* Generate fixed width huffman tables */
 
@@ -459,189 +843,344 @@ static int deflate_block(z_stream_t *strm)
 		for (int i = 280; i <= 287; i++)
 			lit_clens[i] = 8;
 
-		lit_table = hm_create_table(lit_clens, MAX_LITLEN_CODES);
-		dist_table = hm_create_table(dist_clens, MAX_DIST_CODES);
+		lit_table = hm_create_table(strm->arena, lit_clens, MAX_LITLEN_CODES);
+		dist_table = hm_create_table(strm->arena, dist_clens, MAX_DIST_CODES);
 	}
 
-	/* Write symbols */
-	pos = 0;
-	int match_no = 0;
+	/* Write symbols, straight through the tokens */
 
-	int match_pos;
-	int match_len;
-	int match_dist;
+	for (size_t i = 0; i < n; i++) {
+		uint32_t tok = seq[i];
+		int sym = TOK_SYM(tok);
 
-	bl_arr_get(strm->bl_arr, match_no, &match_pos, &match_dist, &match_len);
+		if (sym < 256) {
+			err = __put_bits(strm, lit_table[sym].rcode, lit_table[sym].len);
+		} else {
+			/* Back-pointer as one put: length code, its extra bits,
+			distance code and its extra bits, 48 bits at most */
 
-	while (pos < strm->avail_in) {
-		if (pos == match_pos) {
-			/* Write back-pointer, increment POS by LEN and get next match */
-			int len_code = _GET_LEN_CODE(match_len);
-			int len_nbits = LIT_EXTRA_BITS(len_code);
-			int len_extra = match_len - LEN_BASE_VAL(len_code);
+			int dist_code = TOK_DIST_CODE(tok);
 
-			/* Write huffman-encoded length code */
+			uint64_t bits = lit_table[sym].rcode;
+			int nbits = lit_table[sym].len;
 
-			err = safe_write_msbf(strm, lit_table[len_code].code,
-				lit_table[len_code].len);
-			
-			if (err != Z_OK) {
-				free(lit_table);
-				free(dist_table);
+			bits |= (uint64_t)TOK_LEN_EXTRA(tok) << nbits;
+			nbits += LIT_EXTRA_BITS(sym);
+			bits |= (uint64_t)dist_table[dist_code].rcode << nbits;
+			nbits += dist_table[dist_code].len;
+			bits |= (uint64_t)TOK_DIST_EXTRA(tok) << nbits;
+			nbits += DIST_EXTRA_BITS(dist_code);
 
-				return err;
-			}
+			err = __put_bits(strm, bits, nbits);
+		}
 
-			/* Write extra bits for length */
+		if (err != Z_OK)
+			return err;
+	}
 
-			err = safe_write_lsbf(strm, len_extra, len_nbits);
+	/* Write end of block */
 
-			if (err != Z_OK) {
-				free(lit_table);
-				free(dist_table);
+	return __put_bits(strm, lit_table[256].rcode, lit_table[256].len);
+}
 
-				return err;
-			}
+static void parse_reserve(deflate_parse_t *parse, size_t n)
+{
+	if (parse->count + n <= parse->capacity)
+		return;
 
-			int dist_code = _GET_DIST_CODE(match_dist);
-			int dist_nbits = DIST_EXTRA_BITS(dist_code);
-			int dist_extra = match_dist - DIST_BASE_VAL(dist_code);
+	size_t capacity = parse->capacity ? parse->capacity : CHUNK_SIZE;
 
-			/* Write huffman-encoded distance code */
+	while (capacity < parse->count + n)
+		capacity *= 2;
 
-			err = safe_write_msbf(strm, dist_table[dist_code].code,
-				dist_table[dist_code].len);
+	parse->tokens = (uint32_t *)z_realloc(parse->tokens,
+		parse->capacity * sizeof(uint32_t), capacity * sizeof(uint32_t));
+	parse->capacity = capacity;
+}
 
-			if (err != Z_OK) {
-				free(lit_table);
-				free(dist_table);
+static int token_bytes(uint32_t tok, int *dist)
+{
+	*dist = 0;
 
-				return err;
-			}
+	if (tok < 256)
+		return 1;
 
-			/* Write extra bits for distance */
+	int sym = TOK_SYM(tok);
+	int dist_code = TOK_DIST_CODE(tok);
 
-			err = safe_write_lsbf(strm, dist_extra, dist_nbits);
+	/* Code 284 with all extra bits set would be 258, which only 285 may
+	code */
 
-			if (err != Z_OK) {
-				free(lit_table);
-				free(dist_table);
+	if (sym < 257 || sym > 285 || dist_code >= 30 ||
+		TOK_LEN_EXTRA(tok) >> LIT_EXTRA_BITS(sym) ||
+		TOK_DIST_EXTRA(tok) >> DIST_EXTRA_BITS(dist_code) ||
+		(sym == 284 && TOK_LEN_EXTRA(tok) == 31))
+		return 0;
 
-				return err;
-			}
+	*dist = DIST_BASE_VAL(dist_code) + (int)TOK_DIST_EXTRA(tok);
 
-			pos += match_len;
-			(void)bl_arr_get(strm->bl_arr, ++match_no,
-				&match_pos, &match_dist, &match_len);
-		} else {
-			z_byte lit = strm->in[pos];
-			/* Write huffman-encoded literal nad increment POS by 1 */
+	return LEN_BASE_VAL(sym) + (int)TOK_LEN_EXTRA(tok);
+}
 
-			err = safe_write_msbf(strm, lit_table[lit].code, lit_table[lit].len);
+static int check_parse(const deflate_parse_t *parse)
+{
+	uint64_t pos = 0;
 
-			if (err != Z_OK) {
-				free(lit_table);
-				free(dist_table);
+	for (size_t i = 0; i < parse->count; i++) {
+		int dist;
+		int len = token_bytes(parse->tokens[i], &dist);
 
-				return err;
-			}
-			pos++;
-		}
+		if (len == 0 || (uint64_t)dist > pos)
+			return INVALID_PARSE;
+		pos += (uint64_t)len;
 	}
 
+	return pos == parse->size ? Z_OK : INVALID_PARSE;
+}
 
-	/* Write end of block */
-	err = safe_write_msbf(strm, lit_table[256].code, lit_table[256].len);
+static void count_tokens(const deflate_parse_t *parse, size_t start,
+	size_t end, int *lit_freq, int *dist_freq, uint64_t *bytes)
+{
+	for (size_t i = start; i < end; i++) {
+		uint32_t tok = parse->tokens[i];
+		int dist;
+
+		lit_freq[TOK_SYM(tok)]++;
+		if (tok >= 256)
+			dist_freq[TOK_DIST_CODE(tok)]++;
+		*bytes += (uint64_t)token_bytes(tok, &dist);
+	}
+}
 
-	if (err != Z_OK) {
-		free(lit_table);
-		free(dist_table);
+static size_t cut_block(const deflate_parse_t *parse, size_t start,
+	int *lit_freq, int *dist_freq, uint64_t *bytes)
+{
+	size_t end = start;
 
-		return err;
+	while (end < parse->count && *bytes < CHUNK_SIZE) {
+		count_tokens(parse, end, end + 1, lit_freq, dist_freq, bytes);
+		end++;
 	}
 
-	free(lit_table);
-	free(dist_table);
-	update_adler(&strm->adler, strm->in, strm->avail_in);
-	return Z_OK;
+	return end;
 }
 
-static int __fetch_data(z_stream_t *strm)
+static size_t split_block(const deflate_parse_t *parse, size_t start,
+	int *lit_freq, int *dist_freq, uint64_t *bytes)
 {
-	strm->avail_in = (int)fread(strm->in, 1, CHUNK_SIZE, strm->src);
+	/* Grow the block a piece at a time, as long as coding the piece with
+	it is no dearer than coding the two apart */
 
-	if (ferror(strm->src))
-		return FILE_ERROR;
+	size_t end = _MIN(parse->count, start + SPLIT_TOKENS);
 
-	strm->eof = Z_EOF(strm->src);
+	count_tokens(parse, start, end, lit_freq, dist_freq, bytes);
 
-	return Z_OK;
+	while (end < parse->count) {
+		size_t next = _MIN(parse->count, end + SPLIT_TOKENS);
+
+		int lit[MAX_LITLEN_CODES] = {0};
+		lit[256] = 1;
+
+		int dist[MAX_DIST_CODES] = {0};
+		uint64_t piece = 0;
+
+		count_tokens(parse, end, next, lit, dist, &piece);
+
+		int merged_lit[MAX_LITLEN_CODES];
+		int merged_dist[MAX_DIST_CODES];
+
+		for (int i = 0; i < MAX_LITLEN_CODES; i++)
+			merged_lit[i] = lit_freq[i] + lit[i];
+		for (int i = 0; i < MAX_DIST_CODES; i++)
+			merged_dist[i] = dist_freq[i] + dist[i];
+		merged_lit[256] = 1;
+
+		if (block_cost(merged_lit, merged_dist) >
+			block_cost(lit_freq, dist_freq) + block_cost(lit, dist))
+			break;
+
+		memcpy(lit_freq, merged_lit, sizeof(merged_lit));
+		memcpy(dist_freq, merged_dist, sizeof(merged_dist));
+		*bytes += piece;
+		end = next;
+	}
+
+	return end;
 }
 
-static int __dump_output(z_stream_t *strm)
+static uint64_t fixed_cost(const int *lit_freq, const int *dist_freq)
 {
-	(void)fwrite(strm->out, 1, BW_USED_BYTES(strm->bws), strm->dest);
+	uint64_t bits = DEFLATE_HEADER_SIZE;
 
-	if (ferror(strm->dest))
-		return FILE_ERROR;
+	for (int i = 0; i < MAX_LITLEN_CODES; i++) {
+		int len = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+
+		bits += (uint64_t)lit_freq[i] * (uint64_t)len;
+	}
+	for (int i = 0; i < MAX_DIST_CODES; i++)
+		bits += (uint64_t)dist_freq[i] * 5;
 
-	(void)memset(strm->out, 0, CHUNK_SIZE);
-	(void)bws_assign_stream(strm->bws, strm->out, CHUNK_SIZE);
+	return bits;
+}
+
+static uint64_t dyn_cost(const int *lit_freq, const int *dist_freq)
+{
+	/* The entropy of the symbols, and about 4 bits of table per symbol
+	used on top of the fixed part of the header */
+
+	uint64_t bits = DEFLATE_HEADER_SIZE + HLIT_BITS + HDIST_BITS + HCLEN_BITS +
+		3 * MAX_ALPHABET_CODES;
+
+	for (int i = 0; i < MAX_LITLEN_CODES; i++)
+		bits += lit_freq[i] ? 4 : 0;
+	for (int i = 0; i < MAX_DIST_CODES; i++)
+		bits += dist_freq[i] ? 4 : 0;
+
+	return bits + zh_cost(lit_freq, MAX_LITLEN_CODES) +
+		zh_cost(dist_freq, MAX_DIST_CODES);
+}
+
+static uint64_t block_cost(const int *lit_freq, const int *dist_freq)
+{
+	uint64_t fixed = fixed_cost(lit_freq, dist_freq);
+	uint64_t dyn = dyn_cost(lit_freq, dist_freq);
+
+	return _MIN(fixed, dyn);
+}
+
+static void put_le(unsigned char *p, uint64_t val, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = (unsigned char)(val >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int n)
+{
+	uint64_t val = 0;
+
+	for (int i = n - 1; i >= 0; i--)
+		val = val << 8 | p[i];
+
+	return val;
+}
+
+static int deflate_stored(z_stream_t *strm, int is_last)
+{
+	/* Stored blocks of up to STORED_MAX bytes each. Their headers go
+	through OUT, the data straight from IN, both in one vectored write.
+	Nothing is marked for matching, later blocks cannot refer to it */
+
+	int off = 0;
+
+	do {
+		int len = _MIN(strm->avail_in - off, STORED_MAX);
+		int last = is_last && off + len == strm->avail_in;
+
+		(void)__put_bits(strm, (uint64_t)last, DEFLATE_HEADER_SIZE);
+		bww_align(&strm->bw);
+		(void)__put_bits(strm, (uint64_t)len | (uint64_t)(~len & 0xffff) << 16,
+			32);
+		bww_flush(&strm->bw);
+
+		z_iovec iov[2] = {
+			{strm->out, (size_t)(strm->bw.out - strm->out)},
+			{strm->in + off, (size_t)len}
+		};
+
+		if (zio_writev(strm->io, iov, 2) != 0)
+			return FILE_ERROR;
+		strm->bw.out = strm->out;
+		off += len;
+	} while (off < strm->avail_in);
+
+	update_adler(&strm->adler, strm->in, strm->avail_in);
+	strm->total_out += (uint64_t)strm->avail_in;
+
+	if (strm->io->map)
+		strm->in_pos += (size_t)strm->avail_in;
 
 	return Z_OK;
 }
 
-static int safe_write_lsbf(z_stream_t *strm, int data, int nbits)
+static int __fetch_data(z_stream_t *strm)
 {
-	int res = bws_write_lsbf(strm->bws, data, nbits);
+	if (strm->io->map) {
+		/* Point IN at the next block of the mapping, the data before it
+		already is the window */
 
-	if (res) {
-		int err = __dump_output(strm);
-		if (err != Z_OK)
-			return err;
-		(void)bws_write_lsbf(strm->bws, data >> (nbits - res), res);
+		size_t left = strm->io->map_len - strm->in_pos;
+
+		strm->in = strm->io->map + strm->in_pos;
+		strm->avail_in = (int)_MIN(left, CHUNK_SIZE);
+		strm->lookahead = (int)_MIN(left, CHUNK_SIZE + Z_MAX_MATCH);
+		strm->eof = left <= CHUNK_SIZE;
+
+		return Z_OK;
 	}
 
+	/* Keep the last Z_WSIZE bytes seen as history in front of the buffer */
+
+	if (strm->total_out)
+		(void)memmove(strm->inbuf, strm->in + strm->avail_in - Z_WSIZE, Z_WSIZE);
+
+	long count = zio_read(strm->io, strm->in, CHUNK_SIZE);
+
+	if (count < 0)
+		return FILE_ERROR;
+
+	strm->avail_in = (int)count;
+	strm->lookahead = strm->avail_in;
+	strm->eof = zio_eof(strm->io);
+
 	return Z_OK;
 }
 
-static int safe_write_msbf(z_stream_t *strm, int data, int nbits)
+static int __dump_output(z_stream_t *strm)
 {
-	int res = bws_write_msbf(strm->bws, data, nbits);
+	/* Write out the bytes the bit writer has stored, bits still in its
+	buffer stay there */
 
-	if (res) {
-		int err = __dump_output(strm);
-		if (err != Z_OK)
-			return err;
-		(void)bws_write_msbf(strm->bws, data, res);
-	}
+	size_t used = (size_t)(strm->bw.out - strm->out);
+
+	if (used == 0)
+		return Z_OK;
+
+	if (zio_write(strm->io, strm->out, used) != 0)
+		return FILE_ERROR;
+
+	strm->bw.out = strm->out;
 
 	return Z_OK;
 }
 
-static int safe_write_byte(z_stream_t *strm, z_byte byte)
+static int __flush_output(z_stream_t *strm)
 {
-	bws_flush(strm->bws);
+	/* Write out all complete bytes, the trailing partial byte stays */
 
-	if (bwsEOS(strm->bws)) {
-		int err = __dump_output(strm);
-		if (err != Z_OK)
-			return err;
-	}
+	bww_flush(&strm->bw);
+
+	return __dump_output(strm);
+}
+
+static int __put_bits(z_stream_t *strm, uint64_t bits, int nbits)
+{
+	bww_put(&strm->bw, bits, (unsigned)nbits);
 
-	strm->bws->stream[BW_BYTENO(strm->bws)] = byte;
+	/* The writer stores up to BW_SLACK bytes past its position, dump
+	before it can get there */
 
-	strm->bws->idx += 8;
+	if (strm->bw.out >= strm->out + CHUNK_SIZE)
+		return __dump_output(strm);
 
 	return Z_OK;
 }
 
 static int write_int_be(z_stream_t *strm, int val)
 {
-	for (int i = 3; i >= 0; i--) {
-		z_byte byte = ((unsigned)val >> (8 * i)) & 0xff;
+	bww_align(&strm->bw);
 
-		int err = safe_write_byte(strm, byte);
+	for (int i = 3; i >= 0; i--) {
+		int err = __put_bits(strm, ((unsigned)val >> (8 * i)) & 0xff, 8);
 
 		if (err != Z_OK)
 			return err;
@@ -665,23 +1204,28 @@ static int get_successive_val_count(int *arr, int idx, int n)
     return count;
 }
 
-static huffman_tuple *gen_clen_codes()
+static huffman_tuple *gen_clen_codes(z_arena_t *arena, int *clen_freq,
+	int *clen_clens)
 {
-	int order[MAX_ALPHABET_CODES] =
-		{16, 17, 18, 0, 8, 7,
-		9, 6, 10, 5, 11, 4,
-		12, 3, 13, 2, 14, 1, 15};
-	int codelengths[MAX_ALPHABET_CODES] = {0};
+	int weights[MAX_ALPHABET_CODES];
+	int used = 0;
 
-	for (int i = 0; i < 3; i++) {
-		codelengths[order[i]] = 3;
+	for (int i = 0; i < MAX_ALPHABET_CODES; i++) {
+		weights[i] = clen_freq[i];
+		used += clen_freq[i] != 0;
 	}
-	for (int i = 3; i < 7; i++) {
-		codelengths[order[i]] = 4;
-	}
-	for (int i = 7; i < MAX_ALPHABET_CODES; i++) {
-		codelengths[order[i]] = 5;
+
+	/* Decoders reject an incomplete codelength code, so never let a single
+	symbol get a 1-bit code of its own */
+
+	for (int i = 0; used < 2; i++) {
+		if (!weights[clen_order[i]]) {
+			weights[clen_order[i]] = 1;
+			used++;
+		}
 	}
 
-	return hm_create_table(codelengths, MAX_ALPHABET_CODES);
+	hm_get_codelengths(weights, clen_clens, MAX_ALPHABET_CODES, 7);
+
+	return hm_create_table(arena, clen_clens, MAX_ALPHABET_CODES);
 }
@@ -0,0 +1,343 @@
+#include "fse.h"
+#include <string.h>
+#include "bwstream.h"
+
+static int highbit(uint32_t x)
+{
+	int n = 0;
+	while (x >>= 1)
+		n++;
+	return n;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+#else
+	uint64_t word = 0;
+	for (int i = 7; i >= 0; i--)
+		word = word << 8 | p[i];
+	return word;
+#endif
+}
+
+int fse_table_log(size_t n, int used)
+{
+	int log = FSE_DEFAULT_LOG;
+
+	// no more states than bytes to code, but room for every symbol
+	if (n < ((size_t)1 << log))
+		log = highbit((uint32_t)n) + 1;
+	if (log < highbit((uint32_t)used) + 2)
+		log = highbit((uint32_t)used) + 2;
+
+	if (log < FSE_MIN_LOG)
+		log = FSE_MIN_LOG;
+	if (log > FSE_MAX_LOG)
+		log = FSE_MAX_LOG;
+	return log;
+}
+
+void fse_normalize(short *norm, int log, const int *hist, size_t total)
+{
+	int table_size = 1 << log, sum = 0, largest = 0;
+
+	for (int s = 0; s < 256; s++) {
+		norm[s] = 0;
+		if (hist[s] == 0)
+			continue;
+
+		uint64_t scaled = (((uint64_t)hist[s] << log) + total / 2) / total;
+		norm[s] = (short)(scaled ? scaled : 1);
+		sum += norm[s];
+		if (hist[s] > hist[largest])
+			largest = s;
+	}
+
+	if (sum <= table_size) {
+		norm[largest] = (short)(norm[largest] + table_size - sum);
+		return;
+	}
+
+	// too many rare symbols rounded up to one state, take the excess from
+	// the largest states, one at a time
+	while (sum > table_size) {
+		int s_max = 0;
+		for (int s = 1; s < 256; s++) {
+			if (norm[s] > norm[s_max])
+				s_max = s;
+		}
+		norm[s_max]--;
+		sum--;
+	}
+}
+
+// Header: 4 bits of LOG - FSE_MIN_LOG, then the normalized counts in symbol
+// order, each in just enough bits for the states still left, until they are
+// all given out. A zero count is followed by 2-bit counts of further zeros,
+// 3 meaning more follow.
+size_t fse_write_header(const short *norm, int log, uint8_t *dst)
+{
+	bw_writer_t bw;
+	int left = 1 << log;
+
+	bww_init(&bw, dst);
+	bww_put(&bw, (uint64_t)(log - FSE_MIN_LOG), 4);
+
+	for (int s = 0; s < 256 && left > 0; s++) {
+		bww_put(&bw, (uint64_t)norm[s],
+			(unsigned)highbit((uint32_t)left) + 1);
+		left -= norm[s];
+
+		if (norm[s] == 0) {
+			int zeros = 0;
+			while (s + 1 + zeros < 256 && norm[s + 1 + zeros] == 0)
+				zeros++;
+			s += zeros;
+
+			for (; zeros >= 3; zeros -= 3)
+				bww_put(&bw, 3, 2);
+			bww_put(&bw, (uint64_t)zeros, 2);
+		}
+	}
+
+	bww_finish(&bw);
+	return (size_t)(bw.out - dst);
+}
+
+// Bounds-checked LSB-first reader for the header
+typedef struct {
+	const uint8_t *src;
+	size_t len;
+	size_t pos;				// in bits
+} fse_hreader_t;
+
+static int hreader_get(fse_hreader_t *rd, int nbits, int *val)
+{
+	if (rd->pos + (size_t)nbits > rd->len * 8)
+		return 0;
+
+	*val = 0;
+	for (int i = 0; i < nbits; i++, rd->pos++)
+		*val |= (rd->src[rd->pos >> 3] >> (rd->pos & 7) & 1) << i;
+	return 1;
+}
+
+size_t fse_read_header(const uint8_t *src, size_t len, short *norm, int *log)
+{
+	fse_hreader_t rd = {src, len, 0};
+	int val;
+
+	if (!hreader_get(&rd, 4, &val) || val + FSE_MIN_LOG > FSE_MAX_LOG)
+		return 0;
+	*log = val + FSE_MIN_LOG;
+
+	int left = 1 << *log, s = 0;
+	memset(norm, 0, 256 * sizeof(short));
+
+	while (left > 0) {
+		if (s >= 256 ||
+			!hreader_get(&rd, highbit((uint32_t)left) + 1, &val) ||
+			val > left)
+			return 0;
+		norm[s++] = (short)val;
+		left -= val;
+
+		if (val == 0) {
+			do {
+				if (!hreader_get(&rd, 2, &val))
+					return 0;
+				s += val;
+			} while (val == 3);
+		}
+	}
+
+	return (rd.pos + 7) >> 3;
+}
+
+// Spread the symbols over the table, far apart so that each one's states
+// cover the whole range
+static void spread_symbols(uint8_t *table_symbol, const short *norm,
+	int log)
+{
+	uint32_t table_size = 1u << log, mask = table_size - 1;
+	uint32_t step = (table_size >> 1) + (table_size >> 3) + 3, pos = 0;
+
+	for (int s = 0; s < 256; s++) {
+		for (int i = 0; i < norm[s]; i++) {
+			table_symbol[pos] = (uint8_t)s;
+			pos = (pos + step) & mask;
+		}
+	}
+}
+
+void fse_build_ctable(fse_ctable_t *ct, const short *norm, int log)
+{
+	uint8_t table_symbol[1 << FSE_MAX_LOG];
+	uint32_t table_size = 1u << log;
+	int cumul[256], total = 0;
+
+	ct->log = log;
+	spread_symbols(table_symbol, norm, log);
+
+	for (int s = 0; s < 256; s++) {
+		fse_symbol_t *sym = &ct->symbols[s];
+		cumul[s] = total;
+
+		if (norm[s] <= 1) {
+			// a single state: always LOG bits out
+			sym->delta_nbits = ((uint32_t)log << 16) - table_size;
+			sym->delta_find = total - 1;
+		} else {
+			int max_bits = log - highbit((uint32_t)norm[s] - 1);
+			uint32_t min_state = (uint32_t)norm[s] << max_bits;
+			sym->delta_nbits = ((uint32_t)max_bits << 16) - min_state;
+			sym->delta_find = total - norm[s];
+		}
+		total += norm[s];
+	}
+
+	// states of each symbol, in table order
+	for (uint32_t u = 0; u < table_size; u++)
+		ct->state_table[cumul[table_symbol[u]]++] =
+			(uint16_t)(table_size + u);
+}
+
+void fse_build_dtable(fse_dentry_t *dt, const short *norm, int log)
+{
+	uint8_t table_symbol[1 << FSE_MAX_LOG];
+	uint32_t table_size = 1u << log, next[256];
+
+	spread_symbols(table_symbol, norm, log);
+	for (int s = 0; s < 256; s++)
+		next[s] = (uint32_t)norm[s];
+
+	for (uint32_t u = 0; u < table_size; u++) {
+		uint8_t s = table_symbol[u];
+		uint32_t state = next[s]++;
+		int nbits = log - highbit(state);
+
+		dt[u].sym = s;
+		dt[u].nbits = (uint8_t)nbits;
+		dt[u].new_state = (uint16_t)((state << nbits) - table_size);
+	}
+}
+
+// Encoder state step for symbol SYM: emit the low bits, move to the state
+// of the symbol's run they leave
+#define FSE_STATES 4			// interleaved state chains, unrolled below
+
+#define FSE_PUT(state, sym)\
+	do {\
+		const fse_symbol_t *tt = &ct->symbols[sym];\
+		unsigned nb = (state + tt->delta_nbits) >> 16;\
+		bww_put(&bw, state & ((1u << nb) - 1), nb);\
+		state = ct->state_table[(int)(state >> nb) + tt->delta_find];\
+	} while (0)
+
+// Symbols are coded last to first, spread over FSE_STATES interleaved states
+// (symbol I belongs to state I % FSE_STATES), so the decoder runs first to
+// last with independent chains to overlap. The final states, in reverse,
+// and a 1 marker bit end the stream.
+size_t fse_encode(const fse_ctable_t *ct, const uint8_t *src, size_t n,
+	uint8_t *dst)
+{
+	bw_writer_t bw;
+	uint32_t table_size = 1u << ct->log;
+	uint32_t state[FSE_STATES];
+	size_t i = n;
+
+	bww_init(&bw, dst);
+	for (int k = 0; k < FSE_STATES; k++)
+		state[k] = table_size;
+
+	// the odd symbols at the end first, then whole rounds
+	while (i % FSE_STATES) {
+		i--;
+		FSE_PUT(state[i % FSE_STATES], src[i]);
+	}
+	for (; i > 0; i -= FSE_STATES) {
+		FSE_PUT(state[3], src[i - 1]);
+		FSE_PUT(state[2], src[i - 2]);
+		FSE_PUT(state[1], src[i - 3]);
+		FSE_PUT(state[0], src[i - 4]);
+	}
+
+	for (int k = FSE_STATES - 1; k >= 0; k--)
+		bww_put(&bw, state[k] - table_size, (unsigned)ct->log);
+	bww_put(&bw, 1, 1);
+	bww_finish(&bw);
+
+	return (size_t)(bw.out - dst);
+}
+
+#undef FSE_PUT
+
+// Backward bit reader: bits are taken from the top of a word loaded at P,
+// which moves down toward the start of the stream
+#define FSE_BITS(nb)\
+	((uint32_t)((bits << (used & 63)) >> 1 >> ((63 - (nb)) & 63)))
+
+#define FSE_RELOAD()\
+	do {\
+		size_t back = used >> 3;\
+		if (back > (size_t)(p - lo))\
+			back = (size_t)(p - lo);\
+		p -= back;\
+		used -= (unsigned)back * 8;\
+		bits = load64(p);\
+	} while (0)
+
+#define FSE_GET(state, out)\
+	do {\
+		fse_dentry_t e = dt[state];\
+		out = e.sym;\
+		state = e.new_state + FSE_BITS(e.nbits);\
+		used += e.nbits;\
+	} while (0)
+
+int fse_decode(const fse_dentry_t *dt, int log, const uint8_t *src,
+	size_t len, uint8_t *dst, size_t n)
+{
+	if (len == 0 || src[len - 1] == 0)
+		return 1;
+
+	// the topmost 1 bit is the marker, everything above it is padding
+	const uint8_t *lo = src - 8, *p = src + len - 8;
+	uint64_t bits = load64(p);
+	unsigned used = 8u - (unsigned)highbit(src[len - 1]);
+
+	uint32_t state[FSE_STATES];
+	for (int k = 0; k < FSE_STATES; k++) {
+		state[k] = FSE_BITS(log);
+		used += (unsigned)log;
+	}
+
+	// a round takes at most 48 bits, a reload leaves at least 57
+	size_t i = 0;
+	for (; i + FSE_STATES <= n; i += FSE_STATES) {
+		FSE_RELOAD();
+		FSE_GET(state[0], dst[i]);
+		FSE_GET(state[1], dst[i + 1]);
+		FSE_GET(state[2], dst[i + 2]);
+		FSE_GET(state[3], dst[i + 3]);
+	}
+	for (; i < n; i++) {
+		FSE_RELOAD();
+		FSE_GET(state[i % FSE_STATES], dst[i]);
+	}
+
+	// every bit consumed and all chains back at their initial states
+	size_t consumed = (size_t)(src + len - (p + 8)) * 8 + used;
+	int bad = consumed != len * 8;
+	for (int k = 0; k < FSE_STATES; k++)
+		bad |= state[k] != 0;
+	return bad;
+}
+
+#undef FSE_GET
+#undef FSE_RELOAD
+#undef FSE_BITS
@@ -0,0 +1,67 @@
+#ifndef _FSE_H
+#define _FSE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*	Table-driven ANS (tANS, as in FSE) over bytes. Symbol counts are
+	normalized to a power-of-two table of 1 << log states; a symbol of
+	probability p then costs about -log2(p) bits, fractions included, where
+	a huffman code rounds to whole bits.  */
+
+#define FSE_MIN_LOG 5
+#define FSE_MAX_LOG 12
+#define FSE_DEFAULT_LOG 12
+#define FSE_HEADER_MAX 512			// largest fse_write_header output
+#define FSE_BOUND(n) ((n) * FSE_MAX_LOG / 8 + 16)	// largest fse_encode output
+
+typedef struct {
+	uint16_t new_state;
+	uint8_t sym;
+	uint8_t nbits;
+} fse_dentry_t;
+
+typedef struct {
+	int32_t delta_find;			// to the symbol's run in STATE_TABLE
+	uint32_t delta_nbits;		// bits out, once added and shifted by 16
+} fse_symbol_t;
+
+typedef struct {
+	int log;
+	uint16_t state_table[1 << FSE_MAX_LOG];
+	fse_symbol_t symbols[256];
+} fse_ctable_t;
+
+typedef fse_dentry_t fse_dtable_t[1 << FSE_MAX_LOG];
+
+/*	Table log for N bytes with USED distinct values.  */
+int fse_table_log(size_t n, int used);
+
+/*	Scale the counts of HIST, TOTAL bytes of at least two distinct values,
+	to NORM summing to 1 << LOG. Every present symbol keeps at least one
+	state.  */
+void fse_normalize(short *norm, int log, const int *hist, size_t total);
+
+/*	Compact bit-packed form of NORM and LOG. Returns its size in bytes.  */
+size_t fse_write_header(const short *norm, int log, uint8_t *dst);
+
+/*	Returns the bytes read from the LEN bytes of SRC, 0 if they hold no
+	valid header.  */
+size_t fse_read_header(const uint8_t *src, size_t len, short *norm, int *log);
+
+void fse_build_ctable(fse_ctable_t *ct, const short *norm, int log);
+
+void fse_build_dtable(fse_dentry_t *dt, const short *norm, int log);
+
+/*	Code N bytes of SRC to DST, which holds FSE_BOUND(N) bytes. Returns the
+	size of the bitstream.  */
+size_t fse_encode(const fse_ctable_t *ct, const uint8_t *src, size_t n,
+	uint8_t *dst);
+
+/*	Decode the LEN bytes bitstream at SRC to N bytes of DST. The 8 bytes in
+	front of SRC must be readable. Returns 0 on success, 1 if the stream
+	does not hold exactly N symbols.  */
+int fse_decode(const fse_dentry_t *dt, int log, const uint8_t *src,
+	size_t len, uint8_t *dst, size_t n);
+
+#endif  // _FSE_H
@@ -2,241 +2,265 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
 #include <memory.h>
 #include <stdio.h>
-#include "zheap.h"
 
-#define MAX_BITS 24
+#define _HM_MIN(a, b) ((a) < (b) ? (a) : (b))
 
-static huffman_tree *hm_node_create(int value, int weight);
+static huffman_tree *hm_node_create(z_arena_t *arena, int value);
 
-static inline __attribute__((__always_inline__)) int f_log2(int x)
+/* In-place heapsort of (weight << 16 | symbol) keys, ascending */
+static void hm_sort_keys(uint64_t *keys, int n)
 {
-	int res = -1;
-	while (x) {
-		x >>= 1;
-		res++;
+	for (int i = n / 2 - 1, end = n; end > 1; ) {
+		int root;
+		if (i >= 0) {
+			root = i--;
+		} else {
+			uint64_t top = keys[0];
+			keys[0] = keys[--end];
+			keys[end] = top;
+			root = 0;
+		}
+
+		while (2 * root + 1 < end) {
+			int child = 2 * root + 1;
+			if (child + 1 < end && keys[child + 1] > keys[child])
+				child++;
+			if (keys[root] >= keys[child])
+				break;
+			uint64_t temp = keys[root];
+			keys[root] = keys[child];
+			keys[child] = temp;
+			root = child;
+		}
 	}
-	return res;
 }
 
-static int hm_count_leaves(huffman_tree *tree)
+/*	Optimal length-limited code lengths by package-merge. KEYS holds the M
+	used symbols sorted by weight. Level MAXLEN - 1 lists the leaves; every
+	shallower level merges the leaves with the pairwise packages of the level
+	below it, IS_LEAF remembering which is which. Selecting the 2M - 2
+	cheapest items of level 0 and expanding the packages back down charges
+	each symbol one bit per level it is selected at. Only the first 2M - 2
+	items of a level can ever be selected, longer lists are cut short.  */
+static void package_merge(uint64_t *keys, int m, int *codelengths, int maxlen)
 {
-	if (!tree)
-		return 0;
-	if (HUFFMAN_IS_LEAF(tree))
-		return 1;
-	return hm_count_leaves(tree->left) + hm_count_leaves(tree->right);
-}
+	unsigned char is_leaf[HM_MAX_LEN][2 * HM_MAX_SYMBOLS];
+	int level_len[HM_MAX_LEN];
+	uint64_t items[2][2 * HM_MAX_SYMBOLS];
+	int limit = 2 * m - 2;
 
-static void hm_inorder(huffman_tree *root, int *leaf_symbols, int *leaf_cnt)
-{
-	if (!root)
-		return;
+	/* Deepest level: leaves only */
 
-	hm_inorder(root->left, leaf_symbols, leaf_cnt);
+	uint64_t *curr = items[0];
+	uint64_t *next = items[1];
+	int count = _HM_MIN(m, limit);
 
-	if (HUFFMAN_IS_LEAF(root)) {
-		leaf_symbols[(*leaf_cnt)++] = root->value;
-		return;
+	for (int i = 0; i < count; i++) {
+		curr[i] = keys[i] >> 16;
+		is_leaf[maxlen - 1][i] = 1;
 	}
+	level_len[maxlen - 1] = count;
 
-	hm_inorder(root->right, leaf_symbols, leaf_cnt);
-}
+	for (int level = maxlen - 2; level >= 0; level--) {
+		int packages = count / 2;
+		int leaf = 0, pkg = 0, k = 0;
 
-static huffman_tree *construct_flattened(int *leaf_symbols, int st, int end)
-{
-	if (end - st <= 1)
-		return hm_node_create(leaf_symbols[st], 0);
-	int diff = end - st - 1;
-	int fl = f_log2(diff);
-	huffman_tree *inter = hm_node_create(0, 0);
-	int bound = end - (1 << fl);
-	inter->left = construct_flattened(leaf_symbols, st, bound);
-	inter->right = construct_flattened(leaf_symbols, bound, end);
-
-	return inter;
-}
+		while (k < limit && (leaf < m || pkg < packages)) {
+			uint64_t pkg_weight = pkg < packages ?
+				curr[2 * pkg] + curr[2 * pkg + 1] : 0;
 
-static void flatten(huffman_tree **p_root)
-{
-	int leaf_symbols[64] = {0};
-	int leaf_cnt = 0;
+			if (pkg >= packages ||
+				(leaf < m && (keys[leaf] >> 16) <= pkg_weight)) {
+				next[k] = keys[leaf++] >> 16;
+				is_leaf[level][k++] = 1;
+			} else {
+				next[k] = pkg_weight;
+				is_leaf[level][k++] = 0;
+				pkg++;
+			}
+		}
 
-	hm_inorder(*p_root, leaf_symbols, &leaf_cnt);
+		level_len[level] = k;
+		count = k;
 
-	hm_tree_destroy(*p_root);
+		uint64_t *temp = curr;
+		curr = next;
+		next = temp;
+	}
 
-	*p_root = construct_flattened(leaf_symbols, 0, leaf_cnt);
-}
+	/* Walk back down, the selected leaves of a level are its lightest */
 
-static void flatten_tree(huffman_tree **p_root, int maxlen)
-{
-	while (1) {
-		int leaf_right = hm_count_leaves((*p_root)->right);
+	int selected = limit;
 
-		if (leaf_right > (1 << (maxlen - 1))) {
-			flatten(p_root);
-			return;
-		}
+	for (int level = 0; level < maxlen && selected > 0; level++) {
+		int leaves = 0;
+
+		for (int i = 0; i < selected && i < level_len[level]; i++)
+			leaves += is_leaf[level][i];
 
-		maxlen--;
-		p_root = &(*p_root)->right;
+		for (int i = 0; i < leaves; i++)
+			codelengths[keys[i] & 0xffff]++;
+
+		selected = 2 * (selected - leaves);
 	}
 }
 
-static huffman_tree *hm_node_create(int value, int weight)
+static huffman_tree *hm_node_create(z_arena_t *arena, int value)
 {
-	huffman_tree *node = (huffman_tree *)calloc(1, sizeof(huffman_tree));
-	assert(node);
-	node->weight = weight;
+	huffman_tree *node =
+		(huffman_tree *)za_alloc(arena, sizeof(huffman_tree));
 	node->value = value;
 	return node;
 }
 
-void hm_tree_destroy(huffman_tree *root)
+/*	Moffat-Katajainen in-place huffman code lengths. A holds N >= 2 weights
+	in ascending order and is overwritten with the matching code lengths
+	(non-increasing). The first pass merges into A itself, leaving parent
+	indexes behind; the second turns those into internal node depths; the
+	third hands the depths out to the leaves.  */
+static void hm_minimum_redundancy(uint64_t *A, int n)
 {
-	if (!root)
-		return;
+	int root = 0, leaf = 2;
 
-	hm_tree_destroy(root->left);
-	hm_tree_destroy(root->right);
+	A[0] += A[1];
+	for (int next = 1; next < n - 1; next++) {
+		/* First item of the pair, internal node or leaf */
 
-	free(root);
-}
+		if (leaf >= n || A[root] < A[leaf]) {
+			A[next] = A[root];
+			A[root++] = (uint64_t)next;
+		} else {
+			A[next] = A[leaf++];
+		}
 
-static void hm_codelengths(huffman_tree *root, int *codelengths, int curr)
-{
-	if (!root)
-		return;
+		/* Second item */
 
-	if (HUFFMAN_IS_LEAF(root)) {
-		codelengths[root->value] = curr;
-		return;
+		if (leaf >= n || (root < next && A[root] < A[leaf])) {
+			A[next] += A[root];
+			A[root++] = (uint64_t)next;
+		} else {
+			A[next] += A[leaf++];
+		}
 	}
 
-	hm_codelengths(root->left, codelengths, curr + 1);
-	hm_codelengths(root->right, codelengths, curr + 1);
+	A[n - 2] = 0;
+	for (int next = n - 3; next >= 0; next--)
+		A[next] = A[A[next]] + 1;
+
+	int avbl = 1, used = 0, next = n - 1;
+	uint64_t depth = 0;
+	root = n - 2;
+
+	while (avbl > 0) {
+		while (root >= 0 && A[root] == depth) {
+			used++;
+			root--;
+		}
+		while (avbl > used) {
+			A[next--] = depth;
+			avbl--;
+		}
+		avbl = 2 * used;
+		depth++;
+		used = 0;
+	}
 }
 
 void hm_get_codelengths(int *weights, int *codelengths, int n, int maxlen)
 {
-	memset(codelengths, 0, (size_t)n * sizeof(int));
+	uint64_t keys[HM_MAX_SYMBOLS];
+	uint64_t lens[HM_MAX_SYMBOLS];
+	int m = 0;
+
+	assert(n <= HM_MAX_SYMBOLS && maxlen <= HM_MAX_LEN);
 
-	z_heap *zh = zheap_create();
+	/* Sort the used symbols by weight, once */
 
 	for (int i = 0; i < n; i++) {
-		if (weights[i] != 0) {
-			huffman_tree *node = hm_node_create(i, weights[i]);
-			zheap_push(zh, node, node->weight);
-		}
+		codelengths[i] = 0;
+		if (weights[i] != 0)
+			keys[m++] = (uint64_t)weights[i] << 16 | (uint64_t)i;
 	}
 
-	if (zheap_is_empty(zh)) {
-		fputs("HUFFMAN Error: all weights are zero.\n", stderr);
-		zheap_destroy(zh);
+	if (m == 0)
 		return;
-	}
 
-	if (zheap_get_size(zh) == 1) {
-		huffman_tree *node = zheap_peek(zh);
-		zheap_pop(zh);
-		codelengths[node->value] = 1;
-		free(node);
-		zheap_destroy(zh);
+	if (m == 1) {
+		codelengths[keys[0] & 0xffff] = 1;
 		return;
 	}
 
-	huffman_tree *first, *second;
-	
-	while (zheap_get_size(zh) > 1) {
-		first = zheap_peek(zh);
-		zheap_pop(zh);
-
-		second = zheap_peek(zh);
-		zheap_pop(zh);
-
-		huffman_tree *new_root = hm_node_create(0, 0);
-		huffman_tree *longer = (first->height > second->height) ?
-			first : second;
-		huffman_tree *shorter = (longer == first) ? second : first;
-		new_root->left = shorter;
-		new_root->right = longer;
-		HUFFMAN_CALC_HEIGHT(new_root);
-		HUFFMAN_CALC_WEIGHT(new_root);
-
-		zheap_push(zh, new_root, new_root->weight);
-	}
-
-	huffman_tree *root = zheap_peek(zh);
-	zheap_pop(zh);
-	zheap_destroy(zh);
+	hm_sort_keys(keys, m);
 
-	int height = root->height;
+	for (int i = 0; i < m; i++)
+		lens[i] = keys[i] >> 16;
 
-	hm_codelengths(root, codelengths, 0);
-	hm_tree_destroy(root);
+	hm_minimum_redundancy(lens, m);
 
-	huffman_tuple *table = hm_create_table(codelengths, n);
-	root = hm_create_canonical(table, n);
+	/* The lightest symbol has the longest code */
 
-	if (maxlen != 0 && height > maxlen) {
-		/* Truncate tree to desired max height */
-
-		flatten_tree(&root, maxlen);
-		hm_codelengths(root, codelengths, 0);
+	if (maxlen != 0 && lens[0] > (uint64_t)maxlen) {
+		package_merge(keys, m, codelengths, maxlen);
+		return;
 	}
 
-	/* Get codelengths of tree, cleanup and return */
-	free(table);
-	hm_tree_destroy(root);
-	return;
+	for (int i = 0; i < m; i++)
+		codelengths[keys[i] & 0xffff] = (int)lens[i];
 }
 
-static int comp_hm_tuple(const void *a, const void *b)
+huffman_tuple *hm_create_table(z_arena_t *arena, int *codelengths, int n)
 {
-	int rc = ((huffman_tuple *)a)->len - ((huffman_tuple *)b)->len;
-	if (rc)
-		return rc;
-	return ((huffman_tuple *)a)->val - ((huffman_tuple *)b)->val;
-}
+	huffman_tuple *table =
+		(huffman_tuple *)za_alloc(arena, (size_t)n * sizeof(huffman_tuple));
+	unsigned bl_count[HM_MAX_LEN + 1] = {0};
+	unsigned next_code[HM_MAX_LEN + 1];
 
-static int tuple_sort_alphabetical(const void *a, const void *b)
-{
-	return ((huffman_tuple *)a)->val - ((huffman_tuple *)b)->val;
-}
+	/* Count the codes of each length, RFC 1951 3.2.2 */
 
-huffman_tuple *hm_create_table(int *codelengths, int n)
-{
-	huffman_tuple *table =
-		(huffman_tuple *)calloc((size_t)n, sizeof(huffman_tuple));
-	assert(table);
 	for (int i = 0; i < n; i++) {
-		table[i].val = i;
-		table[i].len = codelengths[i];
+		assert(codelengths[i] >= 0 && codelengths[i] <= HM_MAX_LEN);
+		bl_count[codelengths[i]]++;
 	}
+	bl_count[0] = 0;
 
-	qsort(table, (size_t)n, sizeof(huffman_tuple), comp_hm_tuple);
+	/* Smallest code of each length */
+
+	unsigned code = 0;
+	for (int len = 1; len <= HM_MAX_LEN; len++) {
+		code = (code + bl_count[len - 1]) << 1;
+		next_code[len] = code;
+	}
+
+	/* Hand out consecutive codes in symbol order, with a reversed copy
+	   for writers that emit the least significant bit first */
 
-	int is_set_first = 0;
 	for (int i = 0; i < n; i++) {
-		if (table[i].len == 0)
-			continue;
+		int len = codelengths[i];
 
-		if (!is_set_first) {
-			is_set_first = 1;
+		table[i].val = i;
+		table[i].len = len;
+		if (len == 0)
 			continue;
-		}
-		table[i].code = (table[i - 1].code + 1) << (table[i].len - table[i - 1].len);
+
+		unsigned c = next_code[len]++;
+		unsigned r = 0;
+
+		table[i].code = c;
+		for (int j = 0; j < len; j++, c >>= 1)
+			r = (r << 1) | (c & 1);
+		table[i].rcode = r;
 	}
 
-	qsort(table, (size_t)n, sizeof(huffman_tuple), tuple_sort_alphabetical);
 	return table;
 }
 
-huffman_tree *hm_create_canonical(huffman_tuple *table, int n)
+huffman_tree *hm_create_canonical(z_arena_t *arena, huffman_tuple *table,
+	int n)
 {
-	huffman_tree *root = hm_node_create(0, 0);
+	huffman_tree *root = hm_node_create(arena, 0);
 
 	for (int i = 0; i < n; i++) {
 		if (table[i].len == 0)
@@ -247,19 +271,19 @@ huffman_tree *hm_create_canonical(huffman_tuple *table, int n)
 			int bit = (table[i].code >> j) & 1;
 			if (bit == 0) {
 				if (!temp->left)
-					temp->left = hm_node_create(0, 0);
+					temp->left = hm_node_create(arena, 0);
 				temp = temp->left;
 			} else {
 				if (!temp->right)
-					temp->right = hm_node_create(0, 0);
+					temp->right = hm_node_create(arena, 0);
 				temp = temp->right;
 			}
 		}
 		int bit = table[i].code & 1;
 		if (bit == 0) {
-			temp->left = hm_node_create(table[i].val, 0);
+			temp->left = hm_node_create(arena, table[i].val);
 		} else {
-			temp->right = hm_node_create(table[i].val, 0);
+			temp->right = hm_node_create(arena, table[i].val);
 		}
 	}
 
@@ -1,37 +1,37 @@
 #ifndef _HUFFMAN_H
 #define _HUFFMAN_H
 
+#include "zmem.h"
+
 typedef struct huffman_tree huffman_tree;
 struct huffman_tree
 {
 	huffman_tree *left, *right;
-	int value, weight, height;
+	int value;
 };
 
 typedef struct {
-	int val, len, code;
+	int val, len;
+	unsigned code;		// canonical code, first bit most significant
+	unsigned rcode;		// same code bit-reversed, first bit least significant
 } huffman_tuple;
 
-#ifndef MAX
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#endif  // MAX
+#define HM_MAX_SYMBOLS 512		// largest alphabet hm_get_codelengths handles
+#define HM_MAX_LEN 32			// longest code length limit it accepts
 
 #define HUFFMAN_IS_LEAF(node) (((node)->left || (node)->right) ? 0 : 1)
-#define HUFFMAN_CALC_WEIGHT(node) {\
-	if (!HUFFMAN_IS_LEAF(node))\
-		node->weight = node->left->weight + node->right->weight;\
-	}
-#define HUFFMAN_CALC_HEIGHT(node) (\
-	(node)->height = (HUFFMAN_IS_LEAF(node) ? 0 :\
-	1 + MAX((node)->left->height, (node)->right->height)))
-
-void hm_tree_destroy(huffman_tree *root);
 
+/*	Compute huffman codelengths for N symbols of WEIGHTS. Unless MAXLEN is 0,
+	no length exceeds MAXLEN, at the smallest possible cost in bits. Works
+	in place on the stack, nothing is allocated.  */
 void hm_get_codelengths(int *weights, int *codelengths, int n, int maxlen);
 
-huffman_tuple *hm_create_table(int *codelengths, int n);
+/*	Trees and tables are carved out of ARENA and live until it is reset.  */
+
+huffman_tuple *hm_create_table(z_arena_t *arena, int *codelengths, int n);
 
-huffman_tree *hm_create_canonical(huffman_tuple *table, int n);
+huffman_tree *hm_create_canonical(z_arena_t *arena, huffman_tuple *table,
+	int n);
 
 void hm_debug(huffman_tree *root, int indent);
 
@@ -3,100 +3,396 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stddef.h>
 #include "huffman.h"
 #include "huffman_coding.h"
 #include "bwstream.h"
+#include "zmem.h"
+#include "zthreads.h"
+#include "zhist.h"
+#include "fse.h"
+#include "zerrcodes.h"
 
 #define HMC_MAX_CLEN 32
-#define HMC_BUFLEN 1016
-#define HMC_OVERFLOW_PROT 8
+#define HMC_IOBUF (1 << 16)			// bytes per fread/fwrite
+#define HMC_LUT_BITS 11				// bits resolved by one decoder lookup
+#define HMC_LUT_MASK ((1u << HMC_LUT_BITS) - 1)
+#define HMC_MAGIC_4X 0xF1			// first byte of the four-stream format
+#define HMC_MAGIC_BLOCKS 0xF2		// first byte of the single-pass block format
+#define HMC_BLOCK_KB 256			// default block size of huffman_encode_blocks
+#define HMC_BLOCK_KB_MAX (1 << 20)
+#define HMC_MAGIC_CHUNKS 0xF3		// first byte of the chunked, indexed format
+#define HMC_MAGIC_FSE 0xF4			// first byte of the tANS block format
+#define HMC_FSE_TANS 0				// block coding modes of HMC_MAGIC_FSE
+#define HMC_FSE_RLE 1
+#define HMC_FSE_RAW 2
+#define HMC_INDEX_TAG "HMCX"		// ends the chunk index
+#define HMC_STREAMS 4
+#define HMC_SEG_HEADER 20			// nsyms, payload size, three stream sizes
+#define HMC_SEG_MAX (HMC_STREAMS * HMC_IOBUF)	// largest segment payload
+#define HMC_SEG_BOUND(n) (HMC_SEG_HEADER + HMC_STREAMS + 4 * (n))
+#define HMC_BLOCK_BOUND(n) (4 + 257 + ((n) / HMC_IOBUF + 1) *\
+	(HMC_SEG_HEADER + HMC_STREAMS) + 4 * (n))	// coded size of N bytes, at most
 #define ENDOFSTREAM_SYMBOL 256
 #define MAX_REPEAT_LEN 223
 
-void __write_codelengths(int *codelengths, FILE *out)
-{
-	// Run-length encode canonical tree codelengths and write to file
+#define _HMC_MIN(a, b) ((a) < (b) ? (a) : (b))
 
-	uint8_t run_length_enc_clens[257] = {0};
-	int n = 1;
+// Run-length encode canonical tree codelengths to DST, which has room for
+// 257 bytes. Returns the encoded size.
+static size_t rle_codelengths(int *codelengths, uint8_t *dst)
+{
+	size_t n = 1;
 
-	run_length_enc_clens[0] = (uint8_t)codelengths[0];
+	dst[0] = (uint8_t)codelengths[0];
 	int repeat_count = 0;
 
 	for (int i = 1; i < 257; i++) {
 		if (repeat_count == MAX_REPEAT_LEN) {
-			run_length_enc_clens[n++] = MAX_REPEAT_LEN + HMC_MAX_CLEN;
+			dst[n++] = MAX_REPEAT_LEN + HMC_MAX_CLEN;
 			repeat_count = 0;
-			run_length_enc_clens[n++] = (uint8_t)codelengths[i];
-		} else if (codelengths[i] == run_length_enc_clens[n - 1]) {
+			dst[n++] = (uint8_t)codelengths[i];
+		} else if (codelengths[i] == dst[n - 1]) {
 			repeat_count++;
 		} else if (repeat_count) {
-			run_length_enc_clens[n++] = (uint8_t)(repeat_count + HMC_MAX_CLEN);
+			dst[n++] = (uint8_t)(repeat_count + HMC_MAX_CLEN);
 			repeat_count = 0;
-			run_length_enc_clens[n++] = (uint8_t)codelengths[i];
+			dst[n++] = (uint8_t)codelengths[i];
 		} else {
-			run_length_enc_clens[n++] = (uint8_t)codelengths[i];
+			dst[n++] = (uint8_t)codelengths[i];
 		}
 	}
 
 	// check if last codelength repeats several times
 
 	if (repeat_count) {
-		run_length_enc_clens[n++] = (uint8_t)(repeat_count + HMC_MAX_CLEN);
+		dst[n++] = (uint8_t)(repeat_count + HMC_MAX_CLEN);
 	}
 
-	(void)fwrite(run_length_enc_clens, 1, (size_t)n, out);
+	return n;
 }
 
-void huffman_encode(FILE *in, FILE *out)
+void __write_codelengths(int *codelengths, FILE *out)
+{
+	// Run-length encode canonical tree codelengths and write to file
+
+	uint8_t run_length_enc_clens[257];
+	size_t n = rle_codelengths(codelengths, run_length_enc_clens);
+
+	(void)fwrite(run_length_enc_clens, 1, n, out);
+}
+
+// Format
+//
+// Legacy streams are the run-length encoded codelengths of 257 symbols, then
+// one bitstream ending in ENDOFSTREAM_SYMBOL. Codelength bytes never exceed
+// HMC_MAX_CLEN, which is how a legacy stream is told apart from:
+//
+// HMC_MAGIC_4X, the codelengths (symbol 256 unused), then segments of up to
+// HMC_IOBUF input bytes. A segment starts with HMC_SEG_HEADER bytes, all
+// little endian u32: symbol count, payload size and the sizes of the first
+// three streams. Its symbols are cut in four equal runs (the last ones may be
+// shorter), each coded as an independent bitstream, so the four can be decoded
+// side by side. A lone u32 symbol count of 0 ends the stream.
+//
+// HMC_MAGIC_BLOCKS, then blocks, each coded with a table of its own: u32
+// symbol count of the block (0 ends the stream), its codelengths, then the
+// segments of the block as above, without the terminator.
+//
+// HMC_MAGIC_CHUNKS, then chunks of up to HUFFMAN_CHUNK_SIZE bytes, each one a
+// block as above so that it decodes on its own, and the zero terminator. An
+// index follows: the u64 offset, from the magic byte, of every chunk and of
+// the terminator, then the u32 chunk count and the 4-byte tag HMC_INDEX_TAG.
+//
+// HMC_MAGIC_FSE, then blocks of up to HMC_BLOCK_KB kilobytes coded with tANS
+// instead of huffman codes: u32 symbol count (0 ends the stream) and a mode
+// byte. HMC_FSE_TANS is followed by the u32 size of the rest, the table
+// header of fse_write_header and the bitstream; HMC_FSE_RLE by the one byte
+// the block repeats, HMC_FSE_RAW by the bytes as they are.
+
+static void write_u32(uint8_t *p, uint32_t val)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (uint8_t)(val >> (8 * i));
+}
+
+static void write_u64(uint8_t *p, uint64_t val)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (uint8_t)(val >> (8 * i));
+}
+
+static uint32_t read_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t load_le64(const uint8_t *p)
+{
+	uint64_t word = 0;
+	for (int i = 7; i >= 0; i--)
+		word = word << 8 | p[i];
+	return word;
+}
+
+// Per-thread encoder scratch
+typedef struct {
+	z_arena_t *arena;				// huffman table of the current block
+	uint8_t *bufs[HMC_STREAMS];		// one per stream, with BW_SLACK spare
+} hmc_encoder_t;
+
+static void encoder_init(hmc_encoder_t *enc)
+{
+	enc->arena = za_create(ZA_DEFAULT_CHUNK);
+	for (int k = 0; k < HMC_STREAMS; k++)
+		enc->bufs[k] = (uint8_t *)z_malloc(HMC_IOBUF + BW_SLACK);
+}
+
+static void encoder_free(hmc_encoder_t *enc)
+{
+	for (int k = 0; k < HMC_STREAMS; k++)
+		z_free(enc->bufs[k]);
+	za_destroy(enc->arena);
+}
+
+// Encode N <= HMC_IOBUF bytes of DATA as one segment to DST, which holds
+// HMC_SEG_BOUND(N) bytes. CODES holds each byte's reversed code above its
+// 6-bit length. Returns the segment size.
+static size_t encode_segment(hmc_encoder_t *enc, const uint64_t *codes,
+	const uint8_t *data, size_t n, uint8_t *dst)
+{
+	size_t quarter = (n + HMC_STREAMS - 1) / HMC_STREAMS;
+	const uint8_t *src[HMC_STREAMS];
+	size_t count[HMC_STREAMS];
+	bw_writer_t bw[HMC_STREAMS];
+
+	for (int k = 0; k < HMC_STREAMS; k++) {
+		size_t start = _HMC_MIN((size_t)k * quarter, n);
+		src[k] = data + start;
+		count[k] = _HMC_MIN(quarter, n - start);
+		bww_init(&bw[k], enc->bufs[k]);
+	}
+
+#define PUT_CODE(k, i) bww_put(&bw[k], codes[src[k][i]] >> 6,\
+	(unsigned)(codes[src[k][i]] & 0x3f))
+
+	// all four streams advance together, the last one is the shortest; a
+	// stream holds at most HMC_IOBUF / 4 codes of 32 bits, no overflow check
+	for (size_t i = 0; i < count[3]; i++) {
+		PUT_CODE(0, i);
+		PUT_CODE(1, i);
+		PUT_CODE(2, i);
+		PUT_CODE(3, i);
+	}
+	for (int k = 0; k < HMC_STREAMS - 1; k++) {
+		for (size_t i = count[3]; i < count[k]; i++)
+			PUT_CODE(k, i);
+	}
+
+#undef PUT_CODE
+
+	// segment header and jump table, then the streams
+	size_t size[HMC_STREAMS], total = 0;
+
+	for (int k = 0; k < HMC_STREAMS; k++) {
+		bww_finish(&bw[k]);
+		size[k] = (size_t)(bw[k].out - enc->bufs[k]);
+		total += size[k];
+	}
+
+	write_u32(dst, (uint32_t)n);
+	write_u32(dst + 4, (uint32_t)total);
+	for (int k = 0; k < HMC_STREAMS - 1; k++)
+		write_u32(dst + 8 + 4 * k, (uint32_t)size[k]);
+
+	uint8_t *p = dst + HMC_SEG_HEADER;
+	for (int k = 0; k < HMC_STREAMS; k++) {
+		memcpy(p, enc->bufs[k], size[k]);
+		p += size[k];
+	}
+
+	return (size_t)(p - dst);
+}
+
+// Codelengths for the bytes counted in WEIGTHS, and the matching codes packed
+// for encode_segment
+static void get_codes(z_arena_t *arena, int *weigths, int *codelengths,
+	uint64_t *codes)
+{
+	hm_get_codelengths(weigths, codelengths, 257, HMC_MAX_CLEN);
+
+	huffman_tuple *table = hm_create_table(arena, codelengths, 257);
+	for (int i = 0; i < 256; i++)
+		codes[i] = (uint64_t)table[i].rcode << 6 | (uint64_t)table[i].len;
+}
+
+// Encode N bytes of DATA as a block with a table of its own to DST, which
+// holds HMC_BLOCK_BOUND(N) bytes. Returns the block size.
+static size_t encode_block(hmc_encoder_t *enc, const uint8_t *data, size_t n,
+	uint8_t *dst)
 {
 	int weigths[257] = {0};
-	weigths[ENDOFSTREAM_SYMBOL] = 1;		// For stream terminator
+	zh_count(data, n, weigths);
+
+	int codelengths[257] = {0};
+	uint64_t codes[256];
+	za_reset(enc->arena);
+	get_codes(enc->arena, weigths, codelengths, codes);
+
+	write_u32(dst, (uint32_t)n);
+	size_t size = 4 + rle_codelengths(codelengths, dst + 4);
+
+	for (size_t off = 0; off < n; off += HMC_IOBUF)
+		size += encode_segment(enc, codes, data + off,
+			_HMC_MIN(n - off, HMC_IOBUF), dst + size);
+
+	return size;
+}
+
+// Read up to SIZE bytes, pipes may hand out less than asked at a time
+static size_t read_full(FILE *in, uint8_t *buf, size_t size)
+{
+	size_t n = 0, count;
+
+	while (n < size && (count = fread(buf + n, 1, size - n, in)) > 0)
+		n += count;
+
+	return n;
+}
 
-	// Get symbol frequencies
-	int next_byte;
-	while ((next_byte = fgetc(in)) != EOF) {
-		weigths[next_byte]++;
+void huffman_encode(FILE *in, FILE *out)
+{
+	// Without a way back to the start, code the input in a single pass
+	long start = ftell(in);
+	if (start < 0 || fseek(in, start, SEEK_SET) != 0) {
+		huffman_encode_blocks(in, out, 0);
+		return;
 	}
-	rewind(in);
 
-	// Calculate codelengths for huffman tree
+	int weigths[257] = {0};
+
+	// Get symbol frequencies, a block at a time
+	uint8_t *inbuf = (uint8_t *)z_malloc(HMC_IOBUF);
+	size_t count;
+	while ((count = fread(inbuf, 1, HMC_IOBUF, in)) > 0)
+		zh_count(inbuf, count, weigths);
+	(void)fseek(in, start, SEEK_SET);
+
+	// Calculate codelengths for huffman tree, segments carry their own
+	// symbol counts so no terminator is needed
+	hmc_encoder_t enc;
+	encoder_init(&enc);
 	int codelengths[257] = {0};
-	hm_get_codelengths(weigths, codelengths, 257, HMC_MAX_CLEN);
+	uint64_t codes[256];
+	get_codes(enc.arena, weigths, codelengths, codes);
+	(void)fputc(HMC_MAGIC_4X, out);
 	__write_codelengths(codelengths, out);
 
-	// create huffman table
-	huffman_tuple *table = hm_create_table(codelengths, 257);
+	// encode data, one segment per block read
+	uint8_t *outbuf = (uint8_t *)z_malloc(HMC_SEG_BOUND(HMC_IOBUF));
+	while ((count = fread(inbuf, 1, HMC_IOBUF, in)) > 0) {
+		size_t size = encode_segment(&enc, codes, inbuf, count, outbuf);
+		(void)fwrite(outbuf, 1, size, out);
+	}
 
-	// set up bitwise buffer
-	bw_stream_t *bws = bws_create(BW_M_WRITE);
-	uint8_t buffer[HMC_BUFLEN + HMC_OVERFLOW_PROT] = {0};
-	(void)bws_assign_stream(bws, buffer, HMC_BUFLEN + HMC_OVERFLOW_PROT);
+	// a zero symbol count terminates the stream
+	uint8_t end[4] = {0};
+	(void)fwrite(end, 1, sizeof(end), out);
 
-	// encode data
-	while ((next_byte = fgetc(in)) != EOF) {
-		(void)bws_write_msbf(bws, table[next_byte].code, table[next_byte].len);
+	// perform cleanup and return
+	z_free(outbuf);
+	z_free(inbuf);
+	encoder_free(&enc);
+}
 
-		// avoid overflowing the bitwise processor buffer
-		if (BW_USED_BYTES(bws) > HMC_BUFLEN) {
-			// flush encoded data to output and move bytes from safety buffer
-			// region to the beginning of the buffer
-			(void)fwrite(buffer, 1, HMC_BUFLEN, out);
-			(void)memmove(buffer, buffer + HMC_BUFLEN, HMC_OVERFLOW_PROT);
-			bws->idx -= HMC_BUFLEN << 3;
-			(void)memset(buffer + BW_USED_BYTES(bws), 0, HMC_BUFLEN);
+void huffman_encode_blocks(FILE *in, FILE *out, int block_kb)
+{
+	if (block_kb <= 0)
+		block_kb = HMC_BLOCK_KB;
+	size_t block_size = (size_t)_HMC_MIN(block_kb, HMC_BLOCK_KB_MAX) << 10;
+
+	uint8_t *block = (uint8_t *)z_malloc(block_size);
+	uint8_t *outbuf = (uint8_t *)z_malloc(HMC_BLOCK_BOUND(block_size));
+	hmc_encoder_t enc;
+	encoder_init(&enc);
+
+	(void)fputc(HMC_MAGIC_BLOCKS, out);
+
+	size_t n;
+	while ((n = read_full(in, block, block_size)) > 0) {
+		size_t size = encode_block(&enc, block, n, outbuf);
+		(void)fwrite(outbuf, 1, size, out);
+
+		if (n < block_size)
+			break;
+	}
+
+	// a zero symbol count terminates the stream
+	uint8_t end[4] = {0};
+	(void)fwrite(end, 1, sizeof(end), out);
+
+	encoder_free(&enc);
+	z_free(outbuf);
+	z_free(block);
+}
+
+void huffman_encode_fse(FILE *in, FILE *out)
+{
+	size_t block_size = (size_t)HMC_BLOCK_KB << 10;
+	uint8_t *block = (uint8_t *)z_malloc(block_size);
+	uint8_t *outbuf = (uint8_t *)z_malloc(FSE_HEADER_MAX +
+		FSE_BOUND(block_size) + BW_SLACK);
+	fse_ctable_t *ct = (fse_ctable_t *)z_malloc(sizeof(fse_ctable_t));
+
+	(void)fputc(HMC_MAGIC_FSE, out);
+
+	size_t n;
+	while ((n = read_full(in, block, block_size)) > 0) {
+		int hist[256] = {0}, used = 0;
+		uint8_t head[9];
+
+		zh_count(block, n, hist);
+		for (int c = 0; c < 256; c++)
+			used += hist[c] != 0;
+		write_u32(head, (uint32_t)n);
+
+		// tANS needs two symbols, and is not tried on what the entropy
+		// estimate says it will not shrink
+		if (used == 1) {
+			head[4] = HMC_FSE_RLE;
+			head[5] = block[0];
+			(void)fwrite(head, 1, 6, out);
+		} else if (zh_cost(hist, 256) / 8 >= n - n / 128) {
+			head[4] = HMC_FSE_RAW;
+			(void)fwrite(head, 1, 5, out);
+			(void)fwrite(block, 1, n, out);
+		} else {
+			short norm[256];
+			int log = fse_table_log(n, used);
+
+			fse_normalize(norm, log, hist, n);
+			fse_build_ctable(ct, norm, log);
+			size_t size = fse_write_header(norm, log, outbuf);
+			size += fse_encode(ct, block, n, outbuf + size);
+
+			head[4] = HMC_FSE_TANS;
+			write_u32(head + 5, (uint32_t)size);
+			(void)fwrite(head, 1, 9, out);
+			(void)fwrite(outbuf, 1, size, out);
 		}
+
+		if (n < block_size)
+			break;
 	}
 
-	// write terminator and flush all buffered data to output file
-	(void)bws_write_msbf(bws, table[ENDOFSTREAM_SYMBOL].code,
-		table[ENDOFSTREAM_SYMBOL].len);
-	(void)bws_flush(bws);
-	(void)fwrite(buffer, 1, BW_USED_BYTES(bws), out);
+	// a zero symbol count terminates the stream
+	uint8_t end[4] = {0};
+	(void)fwrite(end, 1, sizeof(end), out);
 
-	// perform cleanup and return
-	bws_destroy(bws);
-	free(table);
+	z_free(ct);
+	z_free(outbuf);
+	z_free(block);
 }
 
 void read_codelengths(int *codelengths, FILE *in)
@@ -107,11 +403,13 @@ void read_codelengths(int *codelengths, FILE *in)
 	while (n < 257) {
 		next_byte = fgetc(in);
 
-		if (next_byte <= HMC_MAX_CLEN) {
+		if (next_byte == EOF) {
+			break;
+		} else if (next_byte <= HMC_MAX_CLEN) {
 			codelengths[n++] = next_byte;
 		} else {
 			int repeat_count = next_byte - HMC_MAX_CLEN;
-			for (int i = 0; i < repeat_count; i++) {
+			for (int i = 0; i < repeat_count && n > 0 && n < 257; i++) {
 				codelengths[n] = codelengths[n - 1];
 				++n;
 			}
@@ -119,56 +417,798 @@ void read_codelengths(int *codelengths, FILE *in)
 	}
 }
 
-void huffman_decode(FILE *in, FILE *out)
+// Decoder lookup entry: up to two symbols resolved by the next
+// HMC_LUT_BITS bits, or none when the first code is longer than that
+#define LUT_ENTRY(sym1, sym2, nsyms, nbits, len1) ((uint32_t)(sym1) |\
+	(uint32_t)(sym2) << 9 | (uint32_t)(nsyms) << 18 |\
+	(uint32_t)(nbits) << 20 | (uint32_t)(len1) << 26)
+#define LUT_SYM1(e) ((int)((e) & 0x1ff))
+#define LUT_SYM2(e) ((int)(((e) >> 9) & 0x1ff))
+#define LUT_NSYMS(e) ((e) >> 18 & 0x3)
+#define LUT_NBITS(e) ((e) >> 20 & 0x3f)
+#define LUT_LEN1(e) ((e) >> 26)		// bits of the first symbol alone
+
+typedef struct {
+	uint64_t bitbuf;			// next bits of input, first one least significant
+	unsigned bitcnt;
+} hmc_bits_t;
+
+// Bit reader over a FILE, for the legacy format
+typedef struct {
+	FILE *in;
+	uint8_t *buf;
+	size_t pos, len;
+	hmc_bits_t bits;
+	unsigned padded;			// zero bits appended after the input ran out
+} hmc_reader_t;
+
+// Bit reader over one stream of a segment in memory. Bytes up to END belong
+// to the stream, the buffer stays readable 8 bytes past it.
+typedef struct {
+	const uint8_t *p, *end;
+	hmc_bits_t bits;
+} hmc_mstream_t;
+
+// Canonical code by lengths, for codes the lookup table does not cover
+typedef struct {
+	int count[HMC_MAX_CLEN + 1];	// number of codes of each length
+	int symbol[257];				// symbols ordered by length, then value
+} hmc_canon_t;
+
+static void build_lut(uint32_t *lut, huffman_tuple *table)
 {
-	int codelengths[257] = {0};
+	const unsigned size = 1u << HMC_LUT_BITS;
+
+	for (unsigned i = 0; i < size; i++)
+		lut[i] = 0;
+
+	for (int s1 = 0; s1 < 257; s1++) {
+		unsigned l1 = (unsigned)table[s1].len;
+		if (l1 == 0 || l1 > HMC_LUT_BITS)
+			continue;
+
+		// single symbol entries for every index starting with this code
+		for (unsigned i = table[s1].rcode; i < size; i += 1u << l1)
+			lut[i] = LUT_ENTRY(s1, 0, 1, l1, l1);
+
+		// nothing follows the terminator
+		if (s1 == ENDOFSTREAM_SYMBOL)
+			continue;
+
+		// second symbols whose code fits in the remaining bits
+		for (int s2 = 0; s2 < 257; s2++) {
+			unsigned l2 = (unsigned)table[s2].len;
+			if (l2 == 0 || l1 + l2 > HMC_LUT_BITS)
+				continue;
+
+			unsigned first = table[s1].rcode | table[s2].rcode << l1;
+			for (unsigned i = first; i < size; i += 1u << (l1 + l2))
+				lut[i] = LUT_ENTRY(s1, s2, 2, l1 + l2, l1);
+		}
+	}
+}
+
+static void build_canon(hmc_canon_t *canon, int *codelengths)
+{
+	int offs[HMC_MAX_CLEN + 2] = {0};
+
+	memset(canon->count, 0, sizeof(canon->count));
+	for (int i = 0; i < 257; i++)
+		canon->count[codelengths[i]]++;
+	canon->count[0] = 0;
+
+	for (int len = 1; len <= HMC_MAX_CLEN; len++)
+		offs[len + 1] = offs[len] + canon->count[len];
+
+	for (int i = 0; i < 257; i++) {
+		if (codelengths[i])
+			canon->symbol[offs[codelengths[i]]++] = i;
+	}
+}
+
+// Top up the bit buffer to at least 56 bits. Once the input is exhausted the
+// buffer is padded with zero bits; a valid stream ends before it can use up
+// 64 of those. Returns 0 on success, 1 on truncated input.
+static int refill(hmc_reader_t *rd)
+{
+	hmc_bits_t *bits = &rd->bits;
+
+	while (bits->bitcnt < 56) {
+		if (rd->pos == rd->len) {
+			rd->pos = 0;
+			rd->len = fread(rd->buf, 1, HMC_IOBUF, rd->in);
+
+			if (rd->len == 0) {
+				rd->padded += 64 - bits->bitcnt;
+				bits->bitcnt = 64;
+				return rd->padded > 128;
+			}
+		}
+
+		if (rd->len - rd->pos >= 8) {
+			// whole word at a time
+			bits->bitbuf |= load_le64(rd->buf + rd->pos) << bits->bitcnt;
+			rd->pos += (63 - bits->bitcnt) >> 3;
+			bits->bitcnt |= 56;
+		} else {
+			bits->bitbuf |= (uint64_t)rd->buf[rd->pos++] << bits->bitcnt;
+			bits->bitcnt += 8;
+		}
+	}
+
+	return 0;
+}
+
+// Word refill, P must be at most END
+static inline void mstream_refill_fast(hmc_mstream_t *s)
+{
+	s->bits.bitbuf |= load_le64(s->p) << s->bits.bitcnt;
+	s->p += (63 - s->bits.bitcnt) >> 3;
+	s->bits.bitcnt |= 56;
+}
+
+// Byte refill, reads zero bits past the end of the stream
+static void mstream_refill(hmc_mstream_t *s)
+{
+	while (s->bits.bitcnt < 56) {
+		if (s->p < s->end)
+			s->bits.bitbuf |= (uint64_t)*s->p++ << s->bits.bitcnt;
+		s->bits.bitcnt += 8;
+	}
+}
+
+// Bit by bit canonical decode, puff style. Codes are sent first bit most
+// significant, and the buffer holds at least HMC_MAX_CLEN bits.
+static int decode_slow(hmc_bits_t *bits, hmc_canon_t *canon)
+{
+	int code = 0, first = 0, index = 0;
+
+	for (unsigned len = 1; len <= HMC_MAX_CLEN; len++) {
+		code |= (int)((bits->bitbuf >> (len - 1)) & 1);
+		int count = canon->count[len];
+
+		if (code - first < count) {
+			bits->bitbuf >>= len;
+			bits->bitcnt -= len;
+			return canon->symbol[index + (code - first)];
+		}
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+
+	return -1;		// not a code, corrupt lengths
+}
+
+// Decode one or two symbols to OUT, which has room for two. Returns the
+// number written; garbage for invalid codes, the caller bounds the output.
+static inline size_t decode_step(hmc_bits_t *bits, const uint32_t *lut,
+	hmc_canon_t *canon, uint8_t *out)
+{
+	uint32_t entry = lut[bits->bitbuf & HMC_LUT_MASK];
+
+	if (LUT_NSYMS(entry)) {
+		out[0] = (uint8_t)LUT_SYM1(entry);
+		out[1] = (uint8_t)LUT_SYM2(entry);
+		bits->bitbuf >>= LUT_NBITS(entry);
+		bits->bitcnt -= LUT_NBITS(entry);
+		return LUT_NSYMS(entry);
+	}
+
+	out[0] = (uint8_t)decode_slow(bits, canon);
+	return 1;
+}
 
-	// fetch codelengths from compressed file
-	read_codelengths(codelengths, in);
+// Decode exactly one symbol to OUT
+static inline void decode_one(hmc_bits_t *bits, const uint32_t *lut,
+	hmc_canon_t *canon, uint8_t *out)
+{
+	uint32_t entry = lut[bits->bitbuf & HMC_LUT_MASK];
 
-	// create canonical huffman tree
-	huffman_tuple *table = hm_create_table(codelengths, 257);
-	huffman_tree *tree = hm_create_canonical(table, 257);
-	free(table);
+	if (LUT_NSYMS(entry)) {
+		*out = (uint8_t)LUT_SYM1(entry);
+		bits->bitbuf >>= LUT_LEN1(entry);
+		bits->bitcnt -= LUT_LEN1(entry);
+	} else {
+		*out = (uint8_t)decode_slow(bits, canon);
+	}
+}
 
-	// set up bitwise processor
-	uint8_t buffer[HMC_BUFLEN + HMC_OVERFLOW_PROT] = {0};
-	bw_stream_t *bws = bws_create(BW_M_READ);
-	(void)bws_assign_stream(bws, buffer, HMC_BUFLEN + HMC_OVERFLOW_PROT);
-	assert(fread(buffer, 1, HMC_BUFLEN + HMC_OVERFLOW_PROT, in) ==
-		   HMC_BUFLEN + HMC_OVERFLOW_PROT);
+// Decoder state shared by all formats
+typedef struct {
+	z_arena_t *arena;			// current table and LUT
+	uint32_t *lut;
+	hmc_canon_t canon;
+	uint8_t *payload;			// segment payload, readable 8 bytes past its end
+	uint8_t *outbuf;
+} hmc_decoder_t;
+
+static void decoder_set_table(hmc_decoder_t *dec, int *codelengths)
+{
+	// build lookup table for short codes, canonical ranges for long ones
+	za_reset(dec->arena);
+	huffman_tuple *table = hm_create_table(dec->arena, codelengths, 257);
+	dec->lut = (uint32_t *)za_alloc(dec->arena,
+		sizeof(uint32_t) << HMC_LUT_BITS);
+	build_lut(dec->lut, table);
+	build_canon(&dec->canon, codelengths);
+}
+
+static void decode_legacy(hmc_decoder_t *dec, FILE *in, FILE *out)
+{
+	const uint32_t *lut = dec->lut;
+
+	// set up buffered bit reader and output buffer
+	hmc_reader_t rd = {in, NULL, 0, 0, {0, 0}, 0};
+	rd.buf = (uint8_t *)z_malloc(HMC_IOBUF);
+	uint8_t *outbuf = dec->outbuf;
+	size_t avail_out = 0;
 
 	// decode data
-	huffman_tree *temp;
-	int next_byte;
-	int input_buffer = 0;
 	while (1) {
-		// decode next byte
-		temp = tree;
-		while (1) {
-			(void)bws_read_lsbf(bws, &input_buffer, 1);
-			temp = input_buffer ? temp->right : temp->left;
-
-			if (HUFFMAN_IS_LEAF(temp)) {
-				next_byte = temp->value;
+		if (rd.bits.bitcnt < HMC_MAX_CLEN && refill(&rd))
+			break;
+
+		uint32_t entry = lut[rd.bits.bitbuf & HMC_LUT_MASK];
+		int sym1, sym2 = -1;
+
+		if (LUT_NSYMS(entry)) {
+			rd.bits.bitbuf >>= LUT_NBITS(entry);
+			rd.bits.bitcnt -= LUT_NBITS(entry);
+			sym1 = LUT_SYM1(entry);
+			if (LUT_NSYMS(entry) == 2)
+				sym2 = LUT_SYM2(entry);
+		} else {
+			sym1 = decode_slow(&rd.bits, &dec->canon);
+			if (sym1 < 0)
 				break;
+		}
+
+		if (sym1 == ENDOFSTREAM_SYMBOL)
+			break;
+		outbuf[avail_out++] = (uint8_t)sym1;
+
+		if (sym2 == ENDOFSTREAM_SYMBOL)
+			break;
+		if (sym2 >= 0)
+			outbuf[avail_out++] = (uint8_t)sym2;
+
+		// write decoded bytes once the buffer is about full
+		if (avail_out > HMC_IOBUF - 2) {
+			(void)fwrite(outbuf, 1, avail_out, out);
+			avail_out = 0;
+		}
+	}
+	(void)fwrite(outbuf, 1, avail_out, out);
+
+	z_free(rd.buf);
+}
+
+// Decode the NSYMS symbols of a segment from PAYLOAD to OUT
+static void decode_segment(const uint8_t *payload, const size_t *size,
+	size_t nsyms, const uint32_t *lut, hmc_canon_t *canon, uint8_t *out)
+{
+	size_t quarter = (nsyms + HMC_STREAMS - 1) / HMC_STREAMS;
+	hmc_mstream_t s[HMC_STREAMS];
+	uint8_t *dst[HMC_STREAMS], *dst_end[HMC_STREAMS];
+
+	for (int k = 0; k < HMC_STREAMS; k++) {
+		size_t start = _HMC_MIN((size_t)k * quarter, nsyms);
+
+		s[k].p = payload;
+		s[k].end = payload + size[k];
+		s[k].bits.bitbuf = 0;
+		s[k].bits.bitcnt = 0;
+		payload += size[k];
+
+		dst[k] = out + start;
+		dst_end[k] = out + start + _HMC_MIN(quarter, nsyms - start);
+	}
+
+	// four independent dependency chains per iteration. A round takes at
+	// most 32 bits, 4 bytes, of each stream; run as many rounds at a time as
+	// leave every stream two symbols per round and keep its reader in bounds
+	while (1) {
+		ptrdiff_t rounds = PTRDIFF_MAX;
+
+		for (int k = 0; k < HMC_STREAMS; k++) {
+			rounds = _HMC_MIN(rounds, (dst_end[k] - dst[k]) / 2);
+			rounds = _HMC_MIN(rounds, (s[k].end - s[k].p) / 4 - 2);
+		}
+		if (rounds <= 0)
+			break;
+
+		for (ptrdiff_t i = 0; i < rounds; i++) {
+			mstream_refill_fast(&s[0]);
+			mstream_refill_fast(&s[1]);
+			mstream_refill_fast(&s[2]);
+			mstream_refill_fast(&s[3]);
+			dst[0] += decode_step(&s[0].bits, lut, canon, dst[0]);
+			dst[1] += decode_step(&s[1].bits, lut, canon, dst[1]);
+			dst[2] += decode_step(&s[2].bits, lut, canon, dst[2]);
+			dst[3] += decode_step(&s[3].bits, lut, canon, dst[3]);
+		}
+	}
+
+	// tails, one symbol at a time
+	for (int k = 0; k < HMC_STREAMS; k++) {
+		while (dst[k] < dst_end[k]) {
+			mstream_refill(&s[k]);
+			decode_one(&s[k].bits, lut, canon, dst[k]++);
+		}
+	}
+}
+
+// Check the rest of a segment header, after its symbol count NSYMS, and get
+// the stream sizes. Returns the payload size, 0 for a segment we could not
+// have written.
+static size_t parse_segment_header(const uint8_t *header, size_t nsyms,
+	size_t *size)
+{
+	size_t total = read_u32(header), sum = 0;
+
+	for (int k = 0; k < HMC_STREAMS - 1; k++) {
+		size[k] = read_u32(header + 4 + 4 * k);
+		sum += size[k];
+	}
+
+	if (nsyms > HMC_IOBUF || total > HMC_SEG_MAX || sum > total)
+		return 0;
+	size[HMC_STREAMS - 1] = total - sum;
+
+	return total;
+}
+
+// Decode a segment of NSYMS symbols, its count already read, from IN to OUT.
+// Returns 0 on success, 1 on a malformed or truncated segment.
+static int decode_segment_file(hmc_decoder_t *dec, size_t nsyms, FILE *in,
+	FILE *out)
+{
+	uint8_t header[HMC_SEG_HEADER - 4];
+
+	if (fread(header, 1, sizeof(header), in) != sizeof(header))
+		return 1;
+
+	size_t size[HMC_STREAMS];
+	size_t total = parse_segment_header(header, nsyms, size);
+	if (total == 0 || fread(dec->payload, 1, total, in) != total)
+		return 1;
+	memset(dec->payload + total, 0, 8);
+
+	decode_segment(dec->payload, size, nsyms, dec->lut, &dec->canon,
+		dec->outbuf);
+	(void)fwrite(dec->outbuf, 1, nsyms, out);
+
+	return 0;
+}
+
+static void decode_4x(hmc_decoder_t *dec, FILE *in, FILE *out)
+{
+	uint8_t count[4];
+
+	// the symbol count comes first, alone it ends the stream
+	while (fread(count, 1, 4, in) == 4 && read_u32(count) != 0) {
+		if (decode_segment_file(dec, read_u32(count), in, out))
+			break;
+	}
+}
+
+static void decode_blocks(hmc_decoder_t *dec, FILE *in, FILE *out)
+{
+	uint8_t count[4];
+
+	while (fread(count, 1, 4, in) == 4 && read_u32(count) != 0) {
+		size_t left = read_u32(count);
+		int codelengths[257] = {0};
+
+		read_codelengths(codelengths, in);
+		decoder_set_table(dec, codelengths);
+
+		// segments up to the block's symbol count
+		while (left > 0) {
+			if (fread(count, 1, 4, in) != 4)
+				return;
+
+			size_t nsyms = read_u32(count);
+			if (nsyms == 0 || nsyms > left ||
+				decode_segment_file(dec, nsyms, in, out))
+				return;
+			left -= nsyms;
+		}
+	}
+}
+
+static void decode_fse(FILE *in, FILE *out)
+{
+	size_t block_size = (size_t)HMC_BLOCK_KB << 10;
+	size_t cap = FSE_HEADER_MAX + FSE_BOUND(block_size);
+	// the bitstream is read backwards, 8 bytes at a time: room in front
+	uint8_t *src = (uint8_t *)z_calloc(8 + cap, 1) + 8;
+	uint8_t *dst = (uint8_t *)z_malloc(block_size);
+	fse_dentry_t *dt = (fse_dentry_t *)z_malloc(sizeof(fse_dtable_t));
+	uint8_t head[5];
+
+	while (fread(head, 1, 5, in) == 5 && read_u32(head) != 0) {
+		size_t n = read_u32(head), size;
+		int c;
+
+		if (n > block_size)
+			break;
+
+		if (head[4] == HMC_FSE_RLE) {
+			if ((c = fgetc(in)) == EOF)
+				break;
+			memset(dst, c, n);
+		} else if (head[4] == HMC_FSE_RAW) {
+			if (fread(dst, 1, n, in) != n)
+				break;
+		} else if (head[4] == HMC_FSE_TANS) {
+			if (fread(head, 1, 4, in) != 4 || (size = read_u32(head)) > cap ||
+				fread(src, 1, size, in) != size)
+				break;
+
+			short norm[256];
+			int log;
+			size_t used = fse_read_header(src, size, norm, &log);
+			if (used == 0)
+				break;
+			fse_build_dtable(dt, norm, log);
+			if (fse_decode(dt, log, src + used, size - used, dst, n))
+				break;
+		} else {
+			break;
+		}
+
+		(void)fwrite(dst, 1, n, out);
+	}
+
+	z_free(dt);
+	z_free(dst);
+	z_free(src - 8);
+}
+
+void huffman_decode(FILE *in, FILE *out)
+{
+	// the first byte tells the format
+	int format = fgetc(in);
+	if (format == EOF)
+		return;
+
+	if (format == HMC_MAGIC_FSE) {
+		decode_fse(in, out);
+		return;
+	}
+
+	hmc_decoder_t dec;
+	dec.arena = za_create(ZA_DEFAULT_CHUNK);
+	dec.payload = (uint8_t *)z_malloc(HMC_SEG_MAX + 8);
+	dec.outbuf = (uint8_t *)z_malloc(HMC_IOBUF);
+
+	if (format == HMC_MAGIC_BLOCKS || format == HMC_MAGIC_CHUNKS) {
+		// a chunked stream reads as blocks, up to the index
+		decode_blocks(&dec, in, out);
+	} else {
+		// one table for the whole stream
+		int codelengths[257] = {0};
+
+		if (format != HMC_MAGIC_4X)
+			(void)ungetc(format, in);
+		read_codelengths(codelengths, in);
+		decoder_set_table(&dec, codelengths);
+
+		if (format == HMC_MAGIC_4X)
+			decode_4x(&dec, in, out);
+		else
+			decode_legacy(&dec, in, out);
+	}
+
+	// perform cleanup
+	z_free(dec.outbuf);
+	z_free(dec.payload);
+	za_destroy(dec.arena);
+}
+
+// Memory counterpart of read_codelengths. Returns the bytes used, 0 if SRC
+// ends before all 257 lengths.
+static size_t parse_codelengths(const uint8_t *src, size_t len,
+	int *codelengths)
+{
+	size_t used = 0;
+	int n = 0;
+
+	while (n < 257) {
+		if (used == len)
+			return 0;
+
+		int next_byte = src[used++];
+		if (next_byte <= HMC_MAX_CLEN) {
+			codelengths[n++] = next_byte;
+		} else {
+			int repeat_count = next_byte - HMC_MAX_CLEN;
+			for (int i = 0; i < repeat_count && n > 0 && n < 257; i++) {
+				codelengths[n] = codelengths[n - 1];
+				++n;
+			}
+		}
+	}
+
+	return used;
+}
+
+// Decode the LEN bytes block at SRC, which is readable 8 bytes past its end,
+// to DST of NSYMS bytes, the symbol count the block must start with.
+// Returns 0 on success, 1 on a malformed block.
+static int decode_block_mem(hmc_decoder_t *dec, const uint8_t *src,
+	size_t len, uint8_t *dst, size_t nsyms)
+{
+	const uint8_t *end = src + len;
+	int codelengths[257] = {0};
+
+	if (len < 4 || read_u32(src) != nsyms)
+		return 1;
+	src += 4;
+
+	size_t used = parse_codelengths(src, (size_t)(end - src), codelengths);
+	if (used == 0)
+		return 1;
+	src += used;
+	decoder_set_table(dec, codelengths);
+
+	while (nsyms > 0) {
+		if (end - src < HMC_SEG_HEADER)
+			return 1;
+
+		size_t size[HMC_STREAMS];
+		size_t count = read_u32(src);
+		size_t total = parse_segment_header(src + 4, count, size);
+		src += HMC_SEG_HEADER;
+
+		if (count == 0 || count > nsyms || total == 0 ||
+			total > (size_t)(end - src))
+			return 1;
+
+		// streams are decoded in place, the next segment or the
+		// padding covers their 8 bytes of lookahead
+		decode_segment(src, size, count, dec->lut, &dec->canon, dst);
+		src += total;
+		dst += count;
+		nsyms -= count;
+	}
+
+	return 0;
+}
+
+// One chunk in flight, in the encoder or in the decoder
+typedef struct {
+	hmc_encoder_t enc;
+	hmc_decoder_t dec;
+	uint8_t *src;
+	uint8_t *dst;
+	size_t src_len;
+	size_t dst_len;
+	size_t src_cap;
+	size_t dst_cap;
+	int err;
+} hmc_chunk_t;
+
+static void encode_chunk(void *arg)
+{
+	hmc_chunk_t *c = (hmc_chunk_t *)arg;
+	c->dst_len = encode_block(&c->enc, c->src, c->src_len, c->dst);
+}
+
+static void decode_chunk(void *arg)
+{
+	hmc_chunk_t *c = (hmc_chunk_t *)arg;
+	c->err = decode_block_mem(&c->dec, c->src, c->src_len, c->dst,
+		c->dst_len);
+}
+
+void huffman_encode_mt(FILE *in, FILE *out, int nthreads)
+{
+	zt_pool_t *pool = zt_create(nthreads);
+	int nslots = zt_size(pool);
+	hmc_chunk_t *slots = (hmc_chunk_t *)z_calloc((size_t)nslots,
+		sizeof(hmc_chunk_t));
+
+	for (int i = 0; i < nslots; i++) {
+		encoder_init(&slots[i].enc);
+		slots[i].src = (uint8_t *)z_malloc(HUFFMAN_CHUNK_SIZE);
+		slots[i].dst = (uint8_t *)z_malloc(
+			HMC_BLOCK_BOUND(HUFFMAN_CHUNK_SIZE));
+	}
+
+	size_t nchunks = 0, cap = 64;
+	uint64_t *offsets = (uint64_t *)z_malloc(cap * sizeof(uint64_t));
+	uint64_t offset = 1;
+	int done = 0;
+
+	(void)fputc(HMC_MAGIC_CHUNKS, out);
+
+	// read a chunk per thread, code them side by side, write them in order
+	while (!done) {
+		int batch = 0;
+
+		while (batch < nslots && !done) {
+			hmc_chunk_t *c = &slots[batch];
+			c->src_len = read_full(in, c->src, HUFFMAN_CHUNK_SIZE);
+
+			done = c->src_len < HUFFMAN_CHUNK_SIZE;
+			if (c->src_len > 0) {
+				zt_submit(pool, encode_chunk, c);
+				batch++;
 			}
 		}
+		zt_wait(pool);
 
-		// avoid overflowing the bitwise processor buffer
-		if (BW_USED_BYTES(bws) > HMC_BUFLEN) {
-			(void)memmove(buffer, buffer + HMC_BUFLEN, HMC_OVERFLOW_PROT);
-			assert(fread(buffer + HMC_OVERFLOW_PROT, 1, HMC_BUFLEN, in) ==
-				   HMC_BUFLEN);
-			bws->idx -= HMC_BUFLEN << 3;
+		for (int i = 0; i < batch; i++) {
+			if (nchunks + 1 >= cap) {
+				offsets = (uint64_t *)z_realloc(offsets,
+					cap * sizeof(uint64_t), 2 * cap * sizeof(uint64_t));
+				cap *= 2;
+			}
+			offsets[nchunks++] = offset;
+			(void)fwrite(slots[i].dst, 1, slots[i].dst_len, out);
+			offset += slots[i].dst_len;
 		}
+	}
+
+	// a zero symbol count terminates the stream, the index follows
+	uint8_t word[8] = {0};
+	(void)fwrite(word, 1, 4, out);
+	offsets[nchunks] = offset;
+
+	for (size_t i = 0; i <= nchunks; i++) {
+		write_u64(word, offsets[i]);
+		(void)fwrite(word, 1, 8, out);
+	}
+	write_u32(word, (uint32_t)nchunks);
+	(void)fwrite(word, 1, 4, out);
+	(void)fwrite(HMC_INDEX_TAG, 1, 4, out);
+
+	// perform cleanup
+	for (int i = 0; i < nslots; i++) {
+		encoder_free(&slots[i].enc);
+		z_free(slots[i].src);
+		z_free(slots[i].dst);
+	}
+	z_free(offsets);
+	z_free(slots);
+	zt_destroy(pool);
+}
+
+// Load the chunk index of the stream starting at START. Returns the chunk
+// count and sets *OFFSETS, or returns -1 if there is no valid index.
+static long read_chunk_index(FILE *in, long start, uint64_t **offsets)
+{
+	uint8_t trailer[8];
+
+	if (fseek(in, -8, SEEK_END) != 0 ||
+		fread(trailer, 1, 8, in) != 8 ||
+		memcmp(trailer + 4, HMC_INDEX_TAG, 4) != 0)
+		return -1;
+
+	long end = ftell(in);
+	size_t nchunks = read_u32(trailer);
+	size_t index_size = (nchunks + 1) * 8;
+
+	// magic byte, chunks and terminator, then the index and trailer
+	if (end < 0 || (uint64_t)(end - start) < 1 + 4 + index_size + 8 ||
+		fseek(in, end - 8 - (long)index_size, SEEK_SET) != 0)
+		return -1;
+
+	uint8_t *raw = (uint8_t *)z_malloc(index_size);
+	uint64_t *idx = (uint64_t *)z_malloc(index_size);
+	int ok = fread(raw, 1, index_size, in) == index_size;
+
+	for (size_t i = 0; ok && i <= nchunks; i++) {
+		idx[i] = load_le64(raw + 8 * i);
+		ok = idx[i] >= (i ? idx[i - 1] + 4 : 1);
+	}
+	ok = ok && idx[nchunks] + 4 + index_size + 8 == (uint64_t)(end - start);
+	z_free(raw);
+
+	if (!ok) {
+		z_free(idx);
+		return -1;
+	}
+	*offsets = idx;
+	return (long)nchunks;
+}
+
+int huffman_decode_mt(FILE *in, FILE *out, int nthreads, size_t first)
+{
+	long start = ftell(in);
+
+	// without the index only a sequential decode of the whole stream is left
+	if (start < 0 || fseek(in, start, SEEK_SET) != 0) {
+		if (first > 0)
+			return FILE_ERROR;
+		huffman_decode(in, out);
+		return Z_OK;
+	}
+
+	if (fgetc(in) != HMC_MAGIC_CHUNKS)
+		return CORRUPT_ZLIB_HEADER;
 
-		if (next_byte == ENDOFSTREAM_SYMBOL) break;
+	uint64_t *offsets;
+	long count = read_chunk_index(in, start, &offsets);
+	if (count < 0)
+		return INVALID_CHUNK_INDEX;
 
-		// write byte to output
-		fputc(next_byte, out);
+	size_t nchunks = (size_t)count;
+	if (first > nchunks) {
+		z_free(offsets);
+		return INVALID_CHUNK_INDEX;
+	}
+
+	zt_pool_t *pool = zt_create(nthreads);
+	int nslots = zt_size(pool);
+	hmc_chunk_t *slots = (hmc_chunk_t *)z_calloc((size_t)nslots,
+		sizeof(hmc_chunk_t));
+
+	for (int i = 0; i < nslots; i++)
+		slots[i].dec.arena = za_create(ZA_DEFAULT_CHUNK);
+
+	// chunks are contiguous, one seek to the first is enough
+	int ret = Z_OK;
+	if (fseek(in, start + (long)offsets[first], SEEK_SET) != 0)
+		ret = FILE_ERROR;
+
+	for (size_t next = first; ret == Z_OK && next < nchunks; ) {
+		int batch = 0;
+
+		for (; batch < nslots && next < nchunks; batch++, next++) {
+			hmc_chunk_t *c = &slots[batch];
+			size_t len = (size_t)(offsets[next + 1] - offsets[next]);
+
+			// nothing to keep, grow by a fresh allocation
+			if (len + 8 > c->src_cap) {
+				z_free(c->src);
+				c->src_cap = len + 8;
+				c->src = (uint8_t *)z_malloc(c->src_cap);
+			}
+			if (fread(c->src, 1, len, in) != len) {
+				ret = STREAM_TOO_SHORT;
+				break;
+			}
+			memset(c->src + len, 0, 8);
+			c->src_len = len;
+
+			// no code is shorter than a bit
+			c->dst_len = read_u32(c->src);
+			if (c->dst_len > 8 * len) {
+				ret = CORRUPT_CHUNK;
+				break;
+			}
+			if (c->dst_len > c->dst_cap) {
+				z_free(c->dst);
+				c->dst_cap = c->dst_len;
+				c->dst = (uint8_t *)z_malloc(c->dst_cap);
+			}
+			zt_submit(pool, decode_chunk, c);
+		}
+		zt_wait(pool);
+
+		for (int i = 0; i < batch; i++) {
+			if (slots[i].err) {
+				ret = CORRUPT_CHUNK;
+				break;
+			}
+			(void)fwrite(slots[i].dst, 1, slots[i].dst_len, out);
+		}
 	}
 
 	// perform cleanup
-	hm_tree_destroy(tree);
+	for (int i = 0; i < nslots; i++) {
+		za_destroy(slots[i].dec.arena);
+		z_free(slots[i].src);
+		z_free(slots[i].dst);
+	}
+	z_free(slots);
+	z_free(offsets);
+	zt_destroy(pool);
+
+	return ret;
 }
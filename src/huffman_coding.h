@@ -5,6 +5,30 @@
 
 void huffman_encode(FILE *in, FILE *out);
 
+/*	Single pass over IN, which may be a pipe: every block of up to BLOCK_KB
+	kilobytes (0 for the default) is coded with a table of its own. Memory
+	use is bounded by the block size. huffman_decode reads the result.  */
+void huffman_encode_blocks(FILE *in, FILE *out, int block_kb);
+
+/*	Same block scheme with tANS in place of huffman codes: fractional bit
+	costs pay off on skewed data, where a code can waste up to a bit per
+	symbol. huffman_decode reads the result.  */
+void huffman_encode_fse(FILE *in, FILE *out);
+
 void huffman_decode(FILE *in, FILE *out);
 
+/*	Uncompressed size of a chunk of huffman_encode_mt, only the last chunk
+	may be shorter: chunk K starts at byte K * HUFFMAN_CHUNK_SIZE.  */
+#define HUFFMAN_CHUNK_SIZE (1 << 20)
+
+/*	Code IN as independent chunks, NTHREADS of them at a time (one per CPU
+	if <= 0), and append an index of the chunks. huffman_decode reads the
+	result sequentially. Needs -lpthread.  */
+void huffman_encode_mt(FILE *in, FILE *out, int nthreads);
+
+/*	Decode a stream of huffman_encode_mt from chunk FIRST on, 0 for all of
+	it, on NTHREADS threads. IN must be seekable and the stream must run to
+	its end, where the index is. Returns Z_OK or a code of zerrcodes.h.  */
+int huffman_decode_mt(FILE *in, FILE *out, int nthreads, size_t first);
+
 #endif  // _HUFFMAN_CODING_H
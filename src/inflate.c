@@ -2,6 +2,9 @@
 #include "zutils.h"
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
+
+#define _MIN(a, b) ((a) < (b) ? (a) : (b))
 
 static int inflate_block(z_stream_t *strm);
 
@@ -19,14 +22,32 @@ static int read_short_be(z_stream_t *strm, unsigned short *val);
 
 static int read_int_be(z_stream_t *strm, int *val);
 
+static int inflate_io(z_io_t *io);
+
 int inflate(FILE *src, FILE *dest)
+{
+	z_io_t io;
+	zio_init_file(&io, src, dest);
+
+	return inflate_io(&io);
+}
+
+int inflate_stream(const z_source *src, const z_sink *dest)
+{
+	z_io_t io;
+	zio_init(&io, src, dest);
+
+	return inflate_io(&io);
+}
+
+static int inflate_io(z_io_t *io)
 {
 	/* Init z_stream and lookup tables */
 
 	luts_init();
 
 	z_stream_t strm, *p_zstrm;
-	zlib_init(&strm, src, dest, Z_MODE_INFLATE);
+	zlib_init(&strm, io, Z_MODE_INFLATE);
 	p_zstrm = &strm;
 
 	/* Get first chunk of input */
@@ -128,6 +149,16 @@ int inflate(FILE *src, FILE *dest)
 		return ADLER_CHECKSUM_ERR;
 	}
 
+	if (p_zstrm->io->error) {
+		zlib_destroy(p_zstrm);
+		return FILE_ERROR;
+	}
+
+	/* Leave the source positioned right after the stream */
+
+	if (p_zstrm->io->map)
+		p_zstrm->in_pos = BW_USED_BYTES(p_zstrm->bws);
+
 	zlib_destroy(&strm);
 
 	return Z_OK;
@@ -143,8 +174,27 @@ static void push_lit_to_output(z_stream_t *strm, unsigned char lit)
 	strm->out[strm->avail_out++] = lit;
 }
 
-static void gen_fixed_huffman_trees(huffman_tree **litlen_codes, 
-	huffman_tree **dist_codes)
+/* Writes pending output followed by LEN stored bytes, in a single call */
+static void pass_through(z_stream_t *strm, z_byte *data, size_t len)
+{
+	cb_push_n(strm->sliding_window, data, len);
+
+	z_iovec iov[2] = {
+		{strm->out, (size_t)strm->avail_out},
+		{data, len}
+	};
+
+	update_adler(&strm->adler, strm->out, strm->avail_out);
+	update_adler(&strm->adler, data, (int)len);
+
+	/* Failures are sticky in strm->io and reported once inflation ends */
+
+	(void)zio_writev(strm->io, iov, 2);
+	strm->avail_out = 0;
+}
+
+static void gen_fixed_huffman_trees(z_arena_t *arena,
+	huffman_tree **litlen_codes, huffman_tree **dist_codes)
 {
 	/* Init default codelengths */
 
@@ -168,18 +218,13 @@ static void gen_fixed_huffman_trees(huffman_tree **litlen_codes,
 	/* Create (auxiliary) huffman tables */
 
 	huffman_tuple *litlen_table, *dist_table;
-	litlen_table = hm_create_table(litlen_clens, MAX_LITLEN_CODES);
-	dist_table = hm_create_table(dist_clens, MAX_DIST_CODES);
+	litlen_table = hm_create_table(arena, litlen_clens, MAX_LITLEN_CODES);
+	dist_table = hm_create_table(arena, dist_clens, MAX_DIST_CODES);
 
 	/* Generate fixed huffman trees */
 
-	*litlen_codes = hm_create_canonical(litlen_table, MAX_LITLEN_CODES);
-	*dist_codes = hm_create_canonical(dist_table, MAX_DIST_CODES);
-
-	/* Destroy huffman tables */
-
-	free(litlen_table);
-	free(dist_table);
+	*litlen_codes = hm_create_canonical(arena, litlen_table, MAX_LITLEN_CODES);
+	*dist_codes = hm_create_canonical(arena, dist_table, MAX_DIST_CODES);
 }
 
 static int huffman_decode_next(z_stream_t *strm, huffman_tree *tree,
@@ -243,21 +288,16 @@ static int read_huffman_codes(z_stream_t *strm,
 	}
 	/* Construct the codelength tree */
 
-	huffman_tuple *clen_table = hm_create_table(alphabet_clens,
+	huffman_tuple *clen_table = hm_create_table(strm->arena, alphabet_clens,
 		MAX_ALPHABET_CODES);
-	huffman_tree *clen_tree = hm_create_canonical(clen_table,
+	huffman_tree *clen_tree = hm_create_canonical(strm->arena, clen_table,
 		MAX_ALPHABET_CODES);
-	free(clen_table);
 
 	int all_codelens[MAX_TOTAL_CODES] = {0};
 	int pos = 0;
 	while (pos < dist_cnt + lit_cnt) {
-		if ((res = huffman_decode_next(strm, clen_tree, &temp)) != Z_OK) {
-			/* Perform cleanup and bail */
-
-			hm_tree_destroy(clen_tree);
+		if ((res = huffman_decode_next(strm, clen_tree, &temp)) != Z_OK)
 			return res;
-		}
 
 		/* Parse all codelengths */
 
@@ -270,10 +310,8 @@ static int read_huffman_codes(z_stream_t *strm,
 			int nbits = CLEN_EXTRA_BITS(temp);
 			int xtra = 0;
 
-			if ((res = safe_read_lsbf(strm, &xtra, nbits)) != Z_OK) {
-				hm_tree_destroy(clen_tree);
+			if ((res = safe_read_lsbf(strm, &xtra, nbits)) != Z_OK)
 				return res;
-			}
 
 			xtra += 3;
 			/* Parse previous codelength for XTRA amount of times */
@@ -287,10 +325,8 @@ static int read_huffman_codes(z_stream_t *strm,
 
 			int nbits = CLEN_EXTRA_BITS(temp);
 			int xtra = 0;
-			if ((res = safe_read_lsbf(strm, &xtra, nbits)) != Z_OK) {
-				hm_tree_destroy(clen_tree);
+			if ((res = safe_read_lsbf(strm, &xtra, nbits)) != Z_OK)
 				return res;
-			}
 			xtra += (temp == 17 ? 3 : 11);
 			/* Parse codelength 0 for XTRA amount of times */
 
@@ -301,21 +337,15 @@ static int read_huffman_codes(z_stream_t *strm,
 		}
 	}
 
-	/* Destroy codelength tree */
-
-	hm_tree_destroy(clen_tree);
-
 	/* Create literal-length and distance trees using the codelengths decoded */
 
-	huffman_tuple *lit_table = hm_create_table(all_codelens, lit_cnt);
-	huffman_tuple *dist_table = hm_create_table(all_codelens + lit_cnt,
-		dist_cnt);
-
-	*litlen_tree = hm_create_canonical(lit_table, lit_cnt);
-	*dist_tree = hm_create_canonical(dist_table, dist_cnt);
+	huffman_tuple *lit_table = hm_create_table(strm->arena, all_codelens,
+		lit_cnt);
+	huffman_tuple *dist_table = hm_create_table(strm->arena,
+		all_codelens + lit_cnt, dist_cnt);
 
-	free(lit_table);
-	free(dist_table);
+	*litlen_tree = hm_create_canonical(strm->arena, lit_table, lit_cnt);
+	*dist_tree = hm_create_canonical(strm->arena, dist_table, dist_cnt);
 
 	return Z_OK;
 }
@@ -353,15 +383,14 @@ static int parse_match(z_stream_t *strm, int code, huffman_tree *dist_tree)
 	if (dist > strm->sliding_window->size)
 		return INVALID_MATCH_LEN;
 
-	/* Push len characters at distance dist to output stream */
+	/* Copy the match in the window and to the output at once */
 
-	for (int i = 0; i < len; i++) {
-		size_t idx = strm->sliding_window->size - dist;
+	if (strm->avail_out + len > CHUNK_SIZE)
+		dump_output(strm);
 
-		/* Get char from desired position */
-		z_byte lit = cb_get(strm->sliding_window, (int)idx);
-		push_lit_to_output(strm, lit);
-	}
+	cb_copy_match(strm->sliding_window, dist, (size_t)len,
+		strm->out + strm->avail_out);
+	strm->avail_out += len;
 
 	return Z_OK;
 }
@@ -370,6 +399,10 @@ static int inflate_block(z_stream_t *strm)
 {
 	int read_result = 0;
 
+	/* Release the previous block's trees */
+
+	za_reset(strm->arena);
+
 	/* read header */
 
 	int header = 0;
@@ -398,60 +431,52 @@ static int inflate_block(z_stream_t *strm)
 		if ((len & 0xffff) != (~nlen & 0xffff))
 			return LEN_CHECK_FAIL;
 
-		/* Read literals and add to output block and to sliding window */
+		/* Pass literals to the sink straight from the input buffer and add
+		them to the sliding window */
 
-		unsigned char lit;
-		for (int i = 0; i < (int)len; i++) {	
-			if ((read_result = safe_read_byte(strm, &lit)) != Z_OK)
+		size_t left = len;
+		while (left) {
+			if (bwsEOS(strm->bws) &&
+				(read_result = read_input(strm)) != Z_OK)
 				return read_result;
-			
-			push_lit_to_output(strm, lit);
+
+			size_t avail = strm->bws->size - BW_BYTENO(strm->bws);
+			size_t run = _MIN(left, avail);
+
+			pass_through(strm, strm->bws->stream + BW_BYTENO(strm->bws), run);
+			strm->bws->idx += run << 3;
+			left -= run;
 		}
 	} else {
 		huffman_tree *litlen_codes = NULL, *dist_codes = NULL;
 		if (btype == DEFLATE_BTYPE_FIX) {
 			/* Generate fixed huffman codes */
 
-			gen_fixed_huffman_trees(&litlen_codes, &dist_codes);
+			gen_fixed_huffman_trees(strm->arena, &litlen_codes, &dist_codes);
 		} else if (btype == DEFLATE_BTYPE_DYN) {
 			/* Read and construct dynamic huffman codes */
 
 			if (read_huffman_codes(strm, &litlen_codes, &dist_codes)
-				!= Z_OK) {
-				/* Perform cleanup and bail */
-
-				hm_tree_destroy(litlen_codes);
-				hm_tree_destroy(dist_codes);
+				!= Z_OK)
 				return STREAM_TOO_SHORT;
-			}
 		}
 		/* Loop until end of block (256) reached */
 		
 		while (1) {
 			int symbol = 0;
 			if (huffman_decode_next(strm, litlen_codes, &symbol)
-				!= Z_OK) {
-				hm_tree_destroy(litlen_codes);
-				hm_tree_destroy(dist_codes);
+				!= Z_OK)
 				return STREAM_TOO_SHORT;
-			}
 			if (symbol <= 255) {
 				push_lit_to_output(strm, (unsigned char)symbol);
 			} else if (symbol == 256) {
 				break;
 			} else {
 				if ((read_result = parse_match(strm, symbol, dist_codes)) !=
-					Z_OK) {
-					
-					hm_tree_destroy(litlen_codes);
-					hm_tree_destroy(dist_codes);
+					Z_OK)
 					return read_result;
-				}
 			}
 		}
-
-		hm_tree_destroy(litlen_codes);
-		hm_tree_destroy(dist_codes);
 	}
 
 	if (is_last)
@@ -460,35 +485,48 @@ static int inflate_block(z_stream_t *strm)
 	return Z_OK;
 }
 
-/* Reads next block of imput from strm->src */
+/* Reads next block of imput from the source */
 static int read_input(z_stream_t *strm)
 {
+	if (strm->io->map) {
+		/* The whole mapping is a single input block */
+
+		if (strm->eof || strm->io->map_len == 0)
+			return STREAM_TOO_SHORT;
+
+		strm->eof = 1;
+		strm->avail_in = (int)_MIN(strm->io->map_len, INT_MAX);
+		(void)bws_assign_stream(strm->bws, strm->io->map, strm->io->map_len);
+		return Z_OK;
+	}
+
 	/* Check for EOF */
-	if (Z_EOF(strm->src))
+	if (zio_eof(strm->io))
 		return STREAM_TOO_SHORT;
 
 	/* Get number of read bytes */
 
-	size_t count = fread(strm->in, 1, CHUNK_SIZE, strm->src);
-	if (ferror(strm->src))
+	long count = zio_read(strm->io, strm->in, CHUNK_SIZE);
+	if (count < 0)
 		return FILE_ERROR;
 
 	/* Set EOF indicator */
 
-	strm->eof = Z_EOF(strm->src);
+	strm->eof = zio_eof(strm->io);
 
 	strm->avail_in = (int)count;
-	(void)bws_assign_stream(strm->bws, strm->in, count);
+	(void)bws_assign_stream(strm->bws, strm->in, (size_t)count);
 	return Z_OK;
 }
 
-/* Writes buffered output to strm->dest */
+/* Writes buffered output to the destination */
 void dump_output(z_stream_t *strm)
 {
-    size_t written = fwrite(strm->out, 1u, (size_t)strm->avail_out, strm->dest);
-	assert(written == (size_t)(strm->avail_out));
+	/* Failures are sticky in strm->io and reported once inflation ends */
+
+	(void)zio_write(strm->io, strm->out, (size_t)strm->avail_out);
 	update_adler(&strm->adler, strm->out, strm->avail_out);
-    strm->avail_out = 0;
+	strm->avail_out = 0;
 }
 
 static int safe_read_lsbf(z_stream_t *strm, int *data, int nbits)
@@ -1,5 +1,9 @@
 #include "lzss.h"
-#include "lzssutils.h"
+#include "zmatch.h"
+#include "zmem.h"
+#include "zutils.h"
+#include "zerrcodes.h"
+#include "zthreads.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,303 +12,1247 @@
 
 #define WINDOW_SIZE 32768
 #define MAX_MATCH_LEN 258
-#define MAX_MARKS 256		// maximum recorded potential match locations
-							// per lookup table entry
+#define WINDOW_LOG 15
+#define MIN_MATCH_LEN 3
+#define MAX_MARKS 256		// chain links followed per search
 
-static int find_match(circ_buff_t *window, circ_buff_t *lookahead_buf,
-	lz_list_t *dict_table, int pos, int *dist, int *len);
+#define LZ_READ_SIZE (1 << 17)	// bytes read per refill of the input window
+#define LZ_OUTBUF (1 << 16)
 
-static void advance(circ_buff_t *window, circ_buff_t *lookahead_buf,
-	lz_list_t *dict_table, int *pos, FILE *out);
+#define LZ_GROUP_MAX 25			// flag byte and 8 matches
+#define LZ_OPT_BLOCK (1 << 16)	// positions parsed at once by the optimal level
+#define LZ_LIT_BITS 9			// flag bit and the byte
+#define LZ_MATCH_BITS 25		// flag bit, distance and length
+#define LZ_DEC_FLUSH (WINDOW_SIZE + (1 << 18))
+#define LZ_DEC_SIZE (LZ_DEC_FLUSH + 8 * MAX_MATCH_LEN + 8)
 
-static void add_entry(lz_list_t *dict_table, circ_buff_t *lookahead_buf,
-	circ_buff_t *window, int pos);
+#define LZ2_MAGIC "LZS\x02"		// format v2 and its version
+#define LZ2_HEADER 5			// magic, then the window log
+#define LZ2_MIN_LOG 15
+#define LZ2_MAX_LOG 24
+#define LZ2_DEFAULT_LOG 22
+#define LZ2_MIN_MATCH 4
+#define LZ2_MAX_MATCH (1 << 16)
+#define LZ2_GROUP_MAX (1 + 8 * 7)	// flag byte and 8 matches of 3 + 4 bytes
+#define LZ2_MAX_CHAIN 48		// chain nodes visited per position
+#define LZ2_DEEP_CHAIN 256		// same with LZSS2_F_DEEP, as deep as v1
+#define LZ2_NICE_MATCH 256		// long enough to stop looking
+#define LZ2_LDM_MIN 64			// bytes under the gear hash, shortest long match
+#define LZ2_LDM_SPACING_LOG 6	// one anchor per 64 positions on average
+#define LZ2_LDM_SHORT_LOG 16	// window of the chains in long-distance mode
+#define LZ2_LDM_TAIL 16			// positions of a long match put in the chains
+
+#define LZF_MAGIC "LZS\x03"		// frame of independent v2 blocks
+#define LZF_HEADER 6			// magic, block log, flags
+#define LZF_INDEX_TAG "LZSX"	// ends the block index
+#define LZF_MIN_LOG 16
+#define LZF_MAX_LOG 26
+#define LZF_DEFAULT_LOG 20
+#define LZF_PRIME (1 << 16)		// bytes of the previous block a block may use
+#define LZF_BOUND(n) ((n) + (n) / 8 + 2 * LZ2_GROUP_MAX)
+
+#define _LZ_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define _LZ_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Input window of the compressors: HISTORY bytes before the current
+// position stay in BUF, reading ahead of it tops BUF up
+typedef struct {
+	FILE *in;
+	uint8_t *buf;
+	size_t capacity;
+	size_t history;
+	size_t lookahead;		// bytes wanted past the current position
+	size_t size;			// valid bytes in BUF
+	size_t cur;				// current position in BUF
+	uint64_t pos;			// stream offset of BUF[CUR]
+	int eof;
+	unsigned *adler;		// checksum of the input read, or NULL
+} lz_input_t;
+
+// Output of the compressors, a group of up to 8 symbols at a time: a flag
+// byte (bit set for a literal) followed by the symbols. Without OUT, BUF
+// must have room for everything.
+typedef struct {
+	FILE *out;
+	uint8_t *buf;
+	size_t cap;
+	size_t used;
+	size_t flags;			// index of the open group's flag byte
+	int nsyms;				// symbols in the open group
+} lz_output_t;
+
+static void init_input(lz_input_t *input, FILE *in, size_t history,
+	size_t read_size, size_t lookahead)
+{
+	input->in = in;
+	input->capacity = history + read_size + lookahead;
+	input->buf = (uint8_t *)z_malloc(input->capacity);
+	input->history = history;
+	input->lookahead = lookahead;
+	input->size = 0;
+	input->cur = 0;
+	input->pos = 0;
+	input->eof = 0;
+	input->adler = NULL;
+}
+
+// Make sure LOOKAHEAD bytes past the current position are in the window,
+// unless the input ends before
+static void fill_input(lz_input_t *input)
+{
+	if (input->eof || input->size - input->cur >= input->lookahead)
+		return;
+
+	// slide, keeping the history
+	if (input->cur > input->history) {
+		size_t drop = input->cur - input->history;
+		memmove(input->buf, input->buf + drop, input->size - drop);
+		input->size -= drop;
+		input->cur -= drop;
+	}
+
+	// a short read means the input has ended
+	size_t room = input->capacity - input->size;
+	size_t count = fread(input->buf + input->size, 1, room, input->in);
+	if (input->adler)
+		update_adler(input->adler, input->buf + input->size, (int)count);
+	input->size += count;
+	input->eof = count < room;
+}
+
+static void init_output(lz_output_t *output, FILE *out, uint8_t *buf,
+	size_t cap)
+{
+	output->out = out;
+	output->buf = buf;
+	output->cap = cap;
+	output->used = 0;
+	output->flags = 0;
+	output->nsyms = 0;
+}
+
+static void flush_output(lz_output_t *output)
+{
+	if (!output->out)
+		return;
+	(void)fwrite(output->buf, 1u, output->used, output->out);
+	output->used = 0;
+}
+
+// Open a new group once the last one holds 8 symbols
+static void begin_symbol(lz_output_t *output)
+{
+	if (output->nsyms == 8 || output->used == 0) {
+		// room for a whole group of either format
+		if (output->used + LZ2_GROUP_MAX > output->cap)
+			flush_output(output);
+		output->flags = output->used;
+		output->buf[output->used++] = 0;
+		output->nsyms = 0;
+	}
+}
+
+static void emit_literal(lz_output_t *output, uint8_t byte)
+{
+	begin_symbol(output);
+	output->buf[output->flags] |= (uint8_t)(1 << output->nsyms++);
+	output->buf[output->used++] = byte;
+}
+
+// format DDDDDDDD DDDDDDDD LLLLLLLL, distance little endian
+static void emit_match(lz_output_t *output, int dist, int len)
+{
+	begin_symbol(output);
+	output->nsyms++;
+	output->buf[output->used++] = (uint8_t)(dist - 1);
+	output->buf[output->used++] = (uint8_t)((dist - 1) >> 8);
+	output->buf[output->used++] = (uint8_t)(len - 3);
+}
 
 void lzss_compress(FILE *in, FILE *out)
 {
-	// set up data structures
-	circ_buff_t *window = cb_create(WINDOW_SIZE);
-	backlink_array_t *matches = bl_arr_create();
-	lz_list_t dict_lookuptable[65536];
-	memset(dict_lookuptable, 0, 65536 * sizeof(lz_list_t));
-	circ_buff_t *lookahead_buffer = cb_create(MAX_MATCH_LEN);
-	
-	// load look-ahead buffer
-	for (int i = 0; i < MAX_MATCH_LEN; i++) {
-		int next_byte = fgetc(in);
-		if (next_byte != EOF) {
-			cb_push(lookahead_buffer, (unsigned char)next_byte);
+	lzss_compress_level(in, out, LZSS_LEVEL_FAST);
+}
+
+// Greedy: each symbol is written as soon as it is found
+static void compress_greedy(zm_finder_t *mf, lz_input_t *input,
+	lz_output_t *output)
+{
+	fill_input(input);
+
+	while (input->cur < input->size) {
+		const uint8_t *scan = input->buf + input->cur;
+		size_t ahead = input->size - input->cur;
+		uint32_t pos = (uint32_t)input->pos, dist = 0;
+
+		uint32_t len = zm_find(mf, scan, ahead, input->cur, pos, &dist);
+		if (len) {
+			emit_match(output, (int)dist, (int)len);
 		} else {
-			break;
+			emit_literal(output, scan[0]);
+			len = 1;
 		}
+
+		zm_insert(mf, scan, len, ahead, pos);
+		input->pos += len;
+		input->cur += len;
+		fill_input(input);
 	}
+}
+
+// Optimal: the longest match at every position of a block, then the
+// cheapest parse of the block by dynamic programming from its end. A
+// literal and a match each take a flag bit, and the match costs the same at
+// any length, so a match of length L stands for all lengths 3 to L.
+static void compress_optimal(zm_finder_t *mf, lz_input_t *input,
+	lz_output_t *output)
+{
+	size_t span_max = LZ_OPT_BLOCK + MAX_MATCH_LEN;
+	zm_match_t *matches = (zm_match_t *)z_malloc(span_max *
+		sizeof(zm_match_t));
+	uint16_t *choice = (uint16_t *)z_malloc(span_max * sizeof(uint16_t));
+	uint32_t *cost = (uint32_t *)z_malloc((span_max + 1) * sizeof(uint32_t));
+	uint32_t *ends = (uint32_t *)z_malloc((span_max + 1) * sizeof(uint32_t));
+
+	// positions from the block start already searched by the last block
+	size_t carried = 0;
 
-	// find matches
+	fill_input(input);
 
-	int pos = 0;
+	while (input->cur < input->size) {
+		const uint8_t *block = input->buf + input->cur;
+		size_t avail = input->size - input->cur;
+		size_t n = _LZ_MIN(avail, LZ_OPT_BLOCK);
 
-	while (cb_get_size(lookahead_buffer) > 2) {
-		// look for matches if there is enough input in the lookahead buffer
-		
-		int len = 0, dist = 0;
-		if (find_match(window, lookahead_buffer, dict_lookuptable,
-		pos, &dist, &len)) {
-			bl_arr_push(matches, pos, dist, len);
-			for (int i = 0; i < len; i++) {
-				advance(window, lookahead_buffer, dict_lookuptable,
-				&pos, in);
+		// the parse looks a match past the block end, so that the last
+		// token is not cut short by it
+		size_t span = _LZ_MIN(avail, n + MAX_MATCH_LEN);
+
+		// every position goes in the chains once, whatever the parse
+		zm_find_range(mf, block + carried, span - carried, avail - carried,
+			input->cur + carried, (uint32_t)(input->pos + carried),
+			matches + carried);
+
+		// cheapest way from each position to the end of the span. Ties go
+		// to the longest match, leaving the short tokens the span end
+		// forces to the tail, which the next block parses again.
+		// A match costs the same at any length, so only its cheapest end
+		// matters: ENDS holds the positions a match from I may end at,
+		// nearest on top, each dearer than every one below it, and the
+		// deepest one in reach is the cheapest and farthest
+		size_t top = 0;
+		cost[span] = 0;
+		for (size_t i = span; i-- > 0; ) {
+			cost[i] = cost[i + 1] + LZ_LIT_BITS;
+			choice[i] = 1;
+
+			if (i + MIN_MATCH_LEN <= span) {
+				uint32_t end = (uint32_t)(i + MIN_MATCH_LEN);
+				while (top && cost[ends[top - 1]] > cost[end])
+					top--;
+				ends[top++] = end;
+			}
+
+			size_t max_len = _LZ_MIN(matches[i].len, span - i);
+			if (max_len < MIN_MATCH_LEN)
+				continue;
+
+			// ENDS decreases from the bottom up, find the first in reach
+			size_t lo = 0, hi = top - 1;
+			while (lo < hi) {
+				size_t mid = (lo + hi) / 2;
+				if (ends[mid] <= i + max_len)
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+
+			if (cost[ends[lo]] + LZ_MATCH_BITS <= cost[i]) {
+				cost[i] = cost[ends[lo]] + LZ_MATCH_BITS;
+				choice[i] = (uint16_t)(ends[lo] - i);
 			}
-		} else {
-			advance(window, lookahead_buffer, dict_lookuptable,
-				&pos, in);
 		}
+
+		// up to the token reaching the block end, the next block starts
+		// where it ends
+		size_t i = 0;
+		while (i < n) {
+			if (choice[i] == 1)
+				emit_literal(output, block[i]);
+			else
+				emit_match(output, (int)matches[i].dist, choice[i]);
+			i += choice[i];
+		}
+
+		carried = span - i;
+		memmove(matches, matches + i, carried * sizeof(zm_match_t));
+
+		input->cur += i;
+		input->pos += i;
+		fill_input(input);
 	}
 
-	rewind(in);
-	pos = 0;
+	z_free(ends);
+	z_free(cost);
+	z_free(choice);
+	z_free(matches);
+}
+
+void lzss_compress_level(FILE *in, FILE *out, int level)
+{
+	// set up data structures
+	zm_params_t params = {WINDOW_LOG, MIN_MATCH_LEN, MAX_MATCH_LEN,
+		MIN_MATCH_LEN, MAX_MARKS, MAX_MATCH_LEN};
+	zm_finder_t mf;
+	zm_init(&mf, &params);
+
+	// the optimal level needs a whole block, the match crossing its end
+	// and the matches of the positions under it ahead
+	lz_input_t input;
+	init_input(&input, in, WINDOW_SIZE, LZ_READ_SIZE, MAX_MATCH_LEN +
+		(level >= LZSS_LEVEL_OPTIMAL ? LZ_OPT_BLOCK + MAX_MATCH_LEN : 0));
+	lz_output_t output;
+	init_output(&output, out, (uint8_t *)z_malloc(LZ_OUTBUF), LZ_OUTBUF);
+
+	if (level >= LZSS_LEVEL_OPTIMAL)
+		compress_optimal(&mf, &input, &output);
+	else
+		compress_greedy(&mf, &input, &output);
+
+	// flush remaining data from buffer to output
+	flush_output(&output);
+
+	// perform cleanup
+	z_free(output.buf);
+	z_free(input.buf);
+	zm_free(&mf);
+}
 
-	// destroy utilitary structures and write compressed data
-	cb_destroy(window);
-	cb_destroy(lookahead_buffer);
-	for (int i = 0; i < 65536; i++) {
-		lzl_clear(&dict_lookuptable[i]);
+// Copy a match of LEN bytes from DIST bytes back. Far enough back, it goes
+// 8 bytes at a time, each copy reading only bytes already written, and may
+// write up to 7 bytes past the match
+static inline void copy_match(uint8_t *op, size_t dist, size_t len)
+{
+	const uint8_t *src = op - dist;
+
+	if (dist >= 8) {
+		uint8_t *end = op + len;
+		do {
+			memcpy(op, src, 8);
+			op += 8;
+			src += 8;
+		} while (op < end);
+	} else if (dist == 1) {
+		memset(op, *src, len);
+	} else {
+		for (size_t i = 0; i < len; i++)
+			op[i] = src[i];
 	}
-	uint8_t outbuf[25] = {0};
-	int buffered_symbols = 0;
-	int buf_idx = 1;
-	int match_no = 0;
-	int match_pos, match_len, match_dist;
-	bl_arr_get(matches, match_no, &match_pos, &match_dist, &match_len);
+}
+
+void lzss_decompress(FILE *in, FILE *out)
+{
+	// input in large reads; output and history in one flat buffer that is
+	// written out and slid down once LZ_DEC_FLUSH bytes are in it
+	uint8_t *ibuf = (uint8_t *)z_malloc(LZ_READ_SIZE);
+	uint8_t *obuf = (uint8_t *)z_malloc(LZ_DEC_SIZE);
+	size_t isize = 0, ip = 0;
+	int ieof = 0;
+	uint8_t *op = obuf, *done = obuf;
 
 	while (1) {
-		if (match_pos == pos) {
-			// output match to buffer in format DDDDDDDD DDDDDDDD LLLLLLLL
-			// little endian
-			*(uint16_t *)(outbuf + buf_idx) = (uint16_t)(match_dist - 1);
-			outbuf[buf_idx + 2] = (uint8_t)(match_len - 3);
-			buf_idx += 3;
-
-			// advance in input file
-			fseek(in, match_len, SEEK_CUR);
-			pos += match_len;
-
-			// load next match
-			bl_arr_get(matches, ++match_no,
-				&match_pos, &match_dist, &match_len);
-		} else {
-			pos++;
-			int next_byte = fgetc(in);
-			if (next_byte != EOF) {
-				outbuf[0] |= (uint8_t)(1 << buffered_symbols);
-				outbuf[buf_idx++] = (uint8_t)next_byte;
+		// top up the input once less than a whole group is left
+		if (isize - ip < LZ_GROUP_MAX && !ieof) {
+			memmove(ibuf, ibuf + ip, isize - ip);
+			isize -= ip;
+			ip = 0;
+
+			size_t count = fread(ibuf + isize, 1, LZ_READ_SIZE - isize, in);
+			ieof = count < LZ_READ_SIZE - isize;
+			isize += count;
+		}
+		if (ip == isize)
+			break;
+
+		// room for a whole group of output
+		if (op - obuf >= LZ_DEC_FLUSH) {
+			(void)fwrite(done, 1, (size_t)(op - done), out);
+			memmove(obuf, op - WINDOW_SIZE, WINDOW_SIZE);
+			op = done = obuf + WINDOW_SIZE;
+		}
+
+		// the last group may be short, stop at the end of the input
+		int flags = ibuf[ip++];
+		const uint8_t *p = ibuf + ip, *end = ibuf + isize;
+
+		for (int i = 0; i < 8; i++) {
+			if ((flags >> i) & 1) {
+				if (p == end)
+					goto finish;
+				*op++ = *p++;
 			} else {
-				break;
+				if (end - p < 3)
+					goto finish;
+
+				size_t dist = (size_t)(p[0] | p[1] << 8) + 1;
+				size_t len = (size_t)p[2] + 3;
+				p += 3;
+
+				// a distance before the start of the stream is corrupt
+				if (dist > (size_t)(op - obuf))
+					goto finish;
+				copy_match(op, dist, len);
+				op += len;
 			}
 		}
-		if (++buffered_symbols == 8) {
-			// write buffer to file and reset buffer
-			(void)fwrite(outbuf, 1u, (size_t)buf_idx, out);
-			buf_idx = 1;
-			memset(outbuf, 0, 25);
-			buffered_symbols = 0;
+		ip = (size_t)(p - ibuf);
+	}
+
+finish:
+	(void)fwrite(done, 1, (size_t)(op - done), out);
+
+	z_free(obuf);
+	z_free(ibuf);
+}
+
+// Format v2: LZ2_MAGIC and the window log, then groups as in v1 with
+// varint tokens. A match is the distance, then the length above
+// LZ2_MIN_MATCH; a distance of 0 ends the stream and is followed by the
+// adler32 of the data, little endian.
+
+// LEB128: 7 bits a byte, low bits first, high bit set if more follow
+static size_t put_varint(uint8_t *dst, uint32_t val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		dst[n++] = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+	dst[n++] = (uint8_t)val;
+	return n;
+}
+
+// Returns 0 if the varint runs past END or over 32 bits
+static int get_varint(const uint8_t **p, const uint8_t *end, uint32_t *val)
+{
+	*val = 0;
+	for (int shift = 0; shift < 32 && *p < end; shift += 7) {
+		uint8_t byte = *(*p)++;
+		*val |= (uint32_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return 1;
+	}
+	return 0;
+}
+
+static void emit_match2(lz_output_t *output, uint32_t dist, uint32_t len)
+{
+	begin_symbol(output);
+	output->nsyms++;
+	output->used += put_varint(output->buf + output->used, dist);
+	output->used += put_varint(output->buf + output->used,
+		len - LZ2_MIN_MATCH);
+}
+
+// Longest match for SCAN at POS, with up to LOOKAHEAD bytes ahead and
+// HISTORY bytes behind it. Returns its length, 0 if none pays for its
+// token.
+static uint32_t lz2_find_match(const zm_finder_t *mf, const uint8_t *scan,
+	size_t lookahead, size_t history, uint32_t pos, uint32_t *dist)
+{
+	uint32_t len = zm_find(mf, scan, lookahead, history, pos, dist);
+
+	// a match must be shorter as a token than as literals
+	uint8_t tmp[10];
+	if (len && put_varint(tmp, *dist) +
+		put_varint(tmp, len - LZ2_MIN_MATCH) >= len)
+		return 0;
+	return len;
+}
+
+// Long-distance matcher: a gear hash rolls over the LZ2_LDM_MIN bytes from
+// each position. Positions where its top LZ2_LDM_SPACING_LOG bits are clear
+// are anchors, picked by content alone, so duplicated regions get anchors at
+// the same places. A sparse table of anchors spans the whole window.
+typedef struct {
+	uint32_t pos;			// low 32 bits of the stream position
+	uint32_t check;			// low bits of the anchor's hash
+} lz2_anchor_t;
+
+typedef struct {
+	lz2_anchor_t *table;
+	int bits;
+	uint32_t window;
+	uint64_t hash;			// over the LZ2_LDM_MIN bytes before FED
+	uint64_t fed;			// stream position of the next byte to roll in
+	uint64_t start;			// first position the hash is complete for
+	uint32_t rep;			// distance of the last long match, or 0
+} lz2_ldm_t;
+
+#define LZ2_LDM_ANCHOR(hash) ((hash) >> (64 - LZ2_LDM_SPACING_LOG) == 0)
+#define LZ2_LDM_SLOT(ldm, hash) ((hash) >> (64 - LZ2_LDM_SPACING_LOG -\
+	(ldm)->bits) & (((uint64_t)1 << (ldm)->bits) - 1))
+
+static uint64_t lz2_gear[256];
+
+static void gear_init()
+{
+	if (lz2_gear[0])
+		return;
+
+	// splitmix64, any fixed set of well mixed values does
+	uint64_t x = 0x9E3779B97F4A7C15u;
+	for (int i = 255; i >= 0; i--) {
+		uint64_t z = (x += 0x9E3779B97F4A7C15u);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+		lz2_gear[i] = z ^ (z >> 31);
+	}
+}
+
+static void ldm_init(lz2_ldm_t *ldm, int window_log)
+{
+	gear_init();
+	ldm->bits = window_log - LZ2_LDM_SPACING_LOG + 1;
+	ldm->table = (lz2_anchor_t *)z_calloc((size_t)1 << ldm->bits,
+		sizeof(lz2_anchor_t));
+	ldm->window = (uint32_t)1 << window_log;
+	ldm->hash = 0;
+	ldm->fed = 0;
+	ldm->start = 0;
+	ldm->rep = 0;
+}
+
+// Roll the hash on to the window at POS (SCAN in the buffer, AHEAD bytes
+// left), registering the anchors passed on the way. Returns 1 if POS itself
+// is an anchor, its slot still to be looked up.
+static int ldm_advance(lz2_ldm_t *ldm, const uint8_t *scan, size_t ahead,
+	uint64_t pos)
+{
+	if (ahead < LZ2_LDM_MIN)
+		return 0;
+
+	// restart after a stretch without a full window
+	if (ldm->fed < pos) {
+		ldm->fed = pos;
+		ldm->start = pos;
+	}
+
+	while (ldm->fed < pos + LZ2_LDM_MIN) {
+		ldm->hash = (ldm->hash << 1) + lz2_gear[scan[ldm->fed - pos]];
+		ldm->fed++;
+
+		uint64_t at = ldm->fed - LZ2_LDM_MIN;
+		if (at >= ldm->start && at < pos && LZ2_LDM_ANCHOR(ldm->hash)) {
+			lz2_anchor_t *slot = &ldm->table[LZ2_LDM_SLOT(ldm, ldm->hash)];
+			slot->pos = (uint32_t)at;
+			slot->check = (uint32_t)ldm->hash;
 		}
 	}
 
-	// flush remaining data from buffer to output
-	if (buffered_symbols) {
-		(void)fwrite(outbuf, 1u, (size_t)buf_idx, out);
+	return pos >= ldm->start && LZ2_LDM_ANCHOR(ldm->hash);
+}
+
+// Long match at POS: at the distance of the last one, or at the anchor
+// sharing the hash of POS. HISTORY bytes are behind SCAN. Returns its
+// length, 0 if none reaches LZ2_LDM_MIN.
+static uint32_t ldm_find(lz2_ldm_t *ldm, const uint8_t *scan, size_t ahead,
+	size_t history, uint64_t pos, int anchor, uint32_t *dist)
+{
+	uint32_t limit = (uint32_t)_LZ_MIN(ahead, LZ2_MAX_MATCH), len = 0;
+
+	if (limit < LZ2_LDM_MIN)
+		return 0;
+
+	if (ldm->rep && ldm->rep <= history) {
+		len = zm_match_len(scan, scan - ldm->rep, limit);
+		if (len >= LZ2_LDM_MIN) {
+			*dist = ldm->rep;
+			return len;
+		}
 	}
 
-	// perform cleanup
-	bl_arr_destroy(matches);
+	if (!anchor)
+		return 0;
+
+	lz2_anchor_t *slot = &ldm->table[LZ2_LDM_SLOT(ldm, ldm->hash)];
+	// the window is far shorter than 4 GiB, the low bits give the distance
+	uint32_t d = (uint32_t)pos - slot->pos;
+
+	len = 0;
+	if (slot->check == (uint32_t)ldm->hash && d > 0 && d <= ldm->window &&
+		d <= history)
+		len = zm_match_len(scan, scan - d, limit);
+
+	slot->pos = (uint32_t)pos;
+	slot->check = (uint32_t)ldm->hash;
+
+	if (len < LZ2_LDM_MIN)
+		return 0;
+	ldm->rep = d;
+	*dist = d;
+	return len;
 }
 
-// decompresses block of 8 symbols and writes data to output.
-// returns 1 if block has less than 8 symbols, 0 otherwise
-static int decompress_block(circ_buff_t *window, int symbol_identifier,
-	uint8_t *block_buffer, int block_size, FILE *out)
+// Matchers of the v2 compressors. POS counts positions from the start of
+// what the chains have seen.
+typedef struct {
+	zm_finder_t finder;
+	lz2_ldm_t ldm;
+	int flags;
+	uint64_t pos;
+} lz2_encoder_t;
+
+// Chains over windows of 1 << CHAIN_LOG, long-distance matching over
+// windows of 1 << WINDOW_LOG if LZSS2_F_LDM is in FLAGS, deeper searches
+// with LZSS2_F_DEEP
+static void lz2_encoder_init(lz2_encoder_t *enc, int chain_log,
+	int window_log, int flags)
 {
-	int block_end = 0;
-	int block_idx = 0;
-	size_t buf_idx = 0;
-	uint8_t out_buffer[258 << 3] = {0};
-	for (int i = 0; i < 8; i++) {
-		if (block_idx >= block_size) {
-			block_end = 1;
-			break;
+	memset(&enc->ldm, 0, sizeof(enc->ldm));
+	if (flags & LZSS2_F_LDM)
+		ldm_init(&enc->ldm, window_log);
+
+	int depth = (flags & LZSS2_F_DEEP) ? LZ2_DEEP_CHAIN : LZ2_MAX_CHAIN;
+	zm_params_t params = {chain_log, LZ2_MIN_MATCH, LZ2_MAX_MATCH,
+		LZ2_MIN_MATCH, depth, LZ2_NICE_MATCH};
+	zm_init(&enc->finder, &params);
+	enc->flags = flags;
+	enc->pos = 0;
+}
+
+static void lz2_encoder_free(lz2_encoder_t *enc)
+{
+	zm_free(&enc->finder);
+	z_free(enc->ldm.table);
+}
+
+// Code BUF from CUR on to OUTPUT, until STOP is reached. SIZE bytes of BUF
+// are valid, the matches may reach up to there and back to its start.
+// Returns where the parse stopped, a long match may take it past STOP.
+static size_t lz2_encode(lz2_encoder_t *enc, const uint8_t *buf, size_t cur,
+	size_t stop, size_t size, lz_output_t *output)
+{
+	uint64_t pos = enc->pos;
+
+	while (cur < stop) {
+		const uint8_t *scan = buf + cur;
+		size_t ahead = size - cur;
+		uint32_t len = 0, dist = 0, first = 0;
+
+		if (enc->flags & LZSS2_F_LDM) {
+			int anchor = ldm_advance(&enc->ldm, scan, ahead, pos);
+			len = ldm_find(&enc->ldm, scan, ahead, cur, pos, anchor, &dist);
+
+			// the chains get the tail of a long match only
+			if (len > LZ2_LDM_TAIL)
+				first = len - LZ2_LDM_TAIL;
 		}
-		if ((symbol_identifier >> i) & 1) {
-			// next symbol is a literal byte
-			uint8_t next_byte = block_buffer[block_idx++];
-			out_buffer[buf_idx++] = next_byte;
-			cb_push(window, next_byte);
+		if (!len && ahead >= LZ2_MIN_MATCH)
+			len = lz2_find_match(&enc->finder, scan, ahead, cur,
+				(uint32_t)pos, &dist);
+
+		if (len) {
+			emit_match2(output, dist, len);
 		} else {
-			int dist_m1 = *(unsigned short *)(block_buffer + block_idx);
-			int len = block_buffer[block_idx + 2] + 3;
-			block_idx += 3;
-
-			// decode len bytes
-			for (int i = 0; i < len; i++) {
-				uint8_t next_byte = cb_get_from_back(window, dist_m1);
-				out_buffer[buf_idx++] = next_byte;
-				cb_push(window, next_byte);
-			}
+			emit_literal(output, scan[0]);
+			len = 1;
 		}
+
+		// every position goes in the chains, the last few cannot hash
+		zm_insert(&enc->finder, scan + first, len - first, ahead - first,
+			(uint32_t)(pos + first));
+
+		pos += len;
+		cur += len;
 	}
 
-	// write decoded data to output
-	(void)fwrite(out_buffer, 1, buf_idx, out);
-	return block_end;
+	enc->pos = pos;
+	return cur;
 }
 
-void lzss_decompress(FILE *in, FILE *out)
+// End marker and checksum, always with room left for them
+static void emit_end2(lz_output_t *output, unsigned adler)
 {
-	// Initialize window
-	circ_buff_t *window = cb_create(WINDOW_SIZE);
-
-	int symbol_identifier;
-	uint8_t block_buffer[24];
-	int last_block = 0;
-
-	// decompress data
-	while (!last_block)
-	{
-		if ((symbol_identifier = fgetc(in)) != EOF) {
-			// calculate block size
-			size_t block_size = 0;
-			size_t read_size;
-			for (int i = 0; i < 8; i++) {
-				block_size += (symbol_identifier >> i) & 1 ? 1 : 3;
-			}
-			if ((read_size = fread(block_buffer, 1, block_size, in))
-				!= block_size) {
-				last_block = 1;
+	begin_symbol(output);
+	output->nsyms++;
+	output->buf[output->used++] = 0;
+	for (int i = 0; i < 4; i++)
+		output->buf[output->used++] = (uint8_t)(adler >> (8 * i));
+}
 
-				if (block_size == 0)
-					break;
-			}
-			if (decompress_block(window, symbol_identifier, block_buffer,
-				(int)read_size, out)) {
-				break;
-			}
-		} else {
-			break;
+void lzss2_compress(FILE *in, FILE *out, int window_log)
+{
+	lzss2_compress_flags(in, out, window_log, 0);
+}
+
+void lzss2_compress_flags(FILE *in, FILE *out, int window_log, int flags)
+{
+	if (window_log == 0)
+		window_log = LZ2_DEFAULT_LOG;
+	window_log = _LZ_MAX(LZ2_MIN_LOG, _LZ_MIN(window_log, LZ2_MAX_LOG));
+	size_t window = (size_t)1 << window_log;
+
+	// read a window at a time, so sliding costs no more than reading
+	unsigned adler = 1;
+	lz_input_t input;
+	init_input(&input, in, window, _LZ_MAX(window, LZ_READ_SIZE),
+		LZ2_MAX_MATCH);
+	input.adler = &adler;
+
+	// in long-distance mode the chains only cover the near past
+	lz2_encoder_t enc;
+	int chain_log = window_log;
+	if (flags & LZSS2_F_LDM)
+		chain_log = _LZ_MIN(window_log, LZ2_LDM_SHORT_LOG);
+	lz2_encoder_init(&enc, chain_log, window_log, flags);
+
+	lz_output_t output;
+	init_output(&output, out, (uint8_t *)z_malloc(LZ_OUTBUF), LZ_OUTBUF);
+
+	// the header, then the first symbol opens a group
+	memcpy(output.buf, LZ2_MAGIC, 4);
+	output.buf[4] = (uint8_t)window_log;
+	output.used = LZ2_HEADER;
+	output.nsyms = 8;
+
+	// parse as long as a whole lookahead is in the window, or to the end
+	fill_input(&input);
+	while (input.cur < input.size) {
+		size_t stop = input.size;
+		if (!input.eof)
+			stop -= input.lookahead - 1;
+
+		input.cur = lz2_encode(&enc, input.buf, input.cur, stop, input.size,
+			&output);
+		fill_input(&input);
+	}
+
+	emit_end2(&output, adler);
+	flush_output(&output);
+
+	// perform cleanup
+	z_free(output.buf);
+	z_free(input.buf);
+	lz2_encoder_free(&enc);
+}
+
+static inline uint32_t lz2_load32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+		(uint32_t)p[3] << 24;
+}
+
+// Decode the group at *P, which is before END, to *OP. The output buffer
+// runs from BASE to LIMIT, with 8 bytes of slack past it for copy_match.
+// Sets *END_MARK at the end marker, leaving *P on the checksum.
+static int lz2_decode_group(const uint8_t **p, const uint8_t *end,
+	const uint8_t *base, uint8_t **op, const uint8_t *limit, int *end_mark)
+{
+	const uint8_t *ip = *p;
+	uint8_t *dst = *op;
+	int flags = *ip++, ret = Z_OK;
+
+	for (int i = 0; i < 8 && ret == Z_OK && !*end_mark; i++) {
+		uint32_t dist, len;
+
+		if ((flags >> i) & 1) {
+			if (ip == end)
+				ret = STREAM_TOO_SHORT;
+			else if (dst == limit)
+				ret = INVALID_MATCH_LEN;
+			else
+				*dst++ = *ip++;
+			continue;
+		}
+
+		if (!get_varint(&ip, end, &dist))
+			ret = STREAM_TOO_SHORT;
+		else if (dist == 0)
+			*end_mark = 1;
+		else if (!get_varint(&ip, end, &len))
+			ret = STREAM_TOO_SHORT;
+		else if (dist > (size_t)(dst - base) ||
+			len > LZ2_MAX_MATCH - LZ2_MIN_MATCH ||
+			len + LZ2_MIN_MATCH > (size_t)(limit - dst))
+			ret = INVALID_MATCH_LEN;
+		else {
+			copy_match(dst, dist, len + LZ2_MIN_MATCH);
+			dst += len + LZ2_MIN_MATCH;
 		}
 	}
-	
-	cb_destroy(window);
-}
-
-// adds a potential match location in the dictionary lookup table and removes
-// the oldest location in the dictionary, and eventually removes the oldest
-// location in a particular dict entry, if there are too many marks
-static void add_entry(lz_list_t *dict_table, circ_buff_t *lookahead_buf,
-	circ_buff_t *window, int pos)
-{
-	int removed = 0;
-	int dict_idx = 0;
-	if (cb_get_size(lookahead_buf) > 2) {
-		// marks current location
-		uint8_t c1 = cb_get(lookahead_buf, 0);
-		uint8_t c2 = cb_get(lookahead_buf, 1);
-		dict_idx = (c1 << 8) + c2;
-		lzl_push_front(&dict_table[dict_idx], pos);
-
-		// if section of dictionary contains too many entries, remove oldest
-		if ((&dict_table[dict_idx])->size > MAX_MARKS) {
-			(void)lzl_pop_back(&dict_table[dict_idx]);
-			removed = 1;
+
+	*p = ip;
+	*op = dst;
+	return ret;
+}
+
+int lzss2_decompress(FILE *in, FILE *out)
+{
+	uint8_t header[LZ2_HEADER];
+
+	if (fread(header, 1, LZ2_HEADER, in) != LZ2_HEADER ||
+		memcmp(header, LZ2_MAGIC, 4) != 0 ||
+		header[4] < LZ2_MIN_LOG || header[4] > LZ2_MAX_LOG)
+		return CORRUPT_ZLIB_HEADER;
+
+	// as in v1: one flat buffer, history in front of the new output
+	size_t window = (size_t)1 << header[4];
+	size_t flush_at = window + _LZ_MAX(window, (size_t)1 << 18);
+	uint8_t *ibuf = (uint8_t *)z_malloc(LZ_READ_SIZE);
+	size_t obuf_size = flush_at + 8 * LZ2_MAX_MATCH;
+	uint8_t *obuf = (uint8_t *)z_malloc(obuf_size + 8);
+	size_t isize = 0, ip = 0;
+	int ieof = 0, ret = Z_OK;
+	uint8_t *op = obuf, *done = obuf;
+	unsigned adler = 1;
+
+	while (1) {
+		// a whole group and the checksum in the input if there are any
+		if (isize - ip < LZ2_GROUP_MAX + 4 && !ieof) {
+			memmove(ibuf, ibuf + ip, isize - ip);
+			isize -= ip;
+			ip = 0;
+
+			size_t count = fread(ibuf + isize, 1, LZ_READ_SIZE - isize, in);
+			ieof = count < LZ_READ_SIZE - isize;
+			isize += count;
+		}
+		if (ip == isize) {
+			ret = STREAM_TOO_SHORT;
+			break;
+		}
+
+		if ((size_t)(op - obuf) >= flush_at) {
+			update_adler(&adler, done, (int)(op - done));
+			(void)fwrite(done, 1, (size_t)(op - done), out);
+			memmove(obuf, op - window, window);
+			op = done = obuf + window;
+		}
+
+		int end_mark = 0;
+		const uint8_t *p = ibuf + ip;
+
+		ret = lz2_decode_group(&p, ibuf + isize, obuf, &op, obuf + obuf_size,
+			&end_mark);
+		ip = (size_t)(p - ibuf);
+
+		if (ret != Z_OK)
+			break;
+
+		// the checksum follows the end marker
+		if (end_mark) {
+			const uint8_t *check = ibuf + ip;
+
+			update_adler(&adler, done, (int)(op - done));
+			if (isize - ip < 4)
+				ret = STREAM_TOO_SHORT;
+			else if (adler != lz2_load32(check))
+				ret = ADLER_CHECKSUM_ERR;
+			break;
 		}
 	}
 
-	// remove oldest entry (it becomes irrelevant as it gets outside of window)
-	uint8_t c1 = cb_get(window, 0);
-	uint8_t c2 = cb_get(window, 1);
+	(void)fwrite(done, 1, (size_t)(op - done), out);
+
+	z_free(obuf);
+	z_free(ibuf);
+	return ret;
+}
+
+// Frames: LZF_MAGIC, the block log and the LZSS_FRAME_* flags, then the
+// blocks, each v2 groups ending with the end marker and the adler32 of the
+// block. Then the index: the offset of every block from the start of the
+// frame and of the index itself, the size of the data, all u64, a u32 block
+// count and LZF_INDEX_TAG. Block K holds the data from K << block log on.
+
+static void lzf_put_le(uint8_t *dst, uint64_t val, int nbytes)
+{
+	for (int i = 0; i < nbytes; i++)
+		dst[i] = (uint8_t)(val >> (8 * i));
+}
+
+static uint64_t lzf_load_le(const uint8_t *src, int nbytes)
+{
+	uint64_t val = 0;
+	for (int i = nbytes - 1; i >= 0; i--)
+		val = val << 8 | src[i];
+	return val;
+}
+
+// One block in flight: RAW holds PRIME bytes of the block before, then the
+// block itself
+typedef struct {
+	lz2_encoder_t enc;
+	uint8_t *raw;
+	uint8_t *packed;
+	size_t prime;
+	size_t raw_len;
+	size_t packed_len;
+	size_t packed_cap;
+	int err;
+} lzf_block_t;
+
+static void encode_block(void *arg)
+{
+	lzf_block_t *b = (lzf_block_t *)arg;
+	lz2_encoder_t *enc = &b->enc;
+	size_t size = b->prime + b->raw_len;
+
+	// the chains start over with the primed bytes
+	zm_reset(&enc->finder);
+	zm_insert(&enc->finder, b->raw, b->prime, size, 0);
+	enc->pos = b->prime;
+
+	lz_output_t output;
+	init_output(&output, NULL, b->packed, b->packed_cap);
+	lz2_encode(enc, b->raw, b->prime, size, size, &output);
+
+	unsigned adler = 1;
+	update_adler(&adler, b->raw + b->prime, (int)b->raw_len);
+	emit_end2(&output, adler);
+	b->packed_len = output.used;
+}
+
+static void decode_block(void *arg)
+{
+	lzf_block_t *b = (lzf_block_t *)arg;
+	const uint8_t *p = b->packed, *end = b->packed + b->packed_len;
+	uint8_t *dst = b->raw + b->prime, *op = dst;
+	int end_mark = 0, ret = Z_OK;
+
+	while (ret == Z_OK && !end_mark && p < end)
+		ret = lz2_decode_group(&p, end, b->raw, &op, dst + b->raw_len,
+			&end_mark);
+
+	// exactly the block, then its checksum and nothing else
+	unsigned adler = 1;
+	update_adler(&adler, dst, (int)(op - dst));
+	if (ret != Z_OK || !end_mark || op != dst + b->raw_len || end - p != 4)
+		b->err = CORRUPT_CHUNK;
+	else if (adler != lz2_load32(p))
+		b->err = ADLER_CHECKSUM_ERR;
+	else
+		b->err = Z_OK;
+}
 
-	if ((dict_idx != (c1 << 8) + c2 || removed == 0) && cb_is_full(window)) {
-		dict_idx = (c1 << 8) + c2;
-		lzl_pop_back(&dict_table[dict_idx]);
+// Bring the last PRIME bytes of PREV, or all of it, in front of B's block
+static void prime_block(lzf_block_t *b, const lzf_block_t *prev,
+	size_t prime)
+{
+	if (!prev || !prime) {
+		b->prime = 0;
+		return;
 	}
+
+	// PREV may be B itself, the tail moves down
+	size_t count = _LZ_MIN(prime, prev->raw_len);
+	memmove(b->raw, prev->raw + prev->prime + prev->raw_len - count, count);
+	b->prime = count;
 }
 
-static void advance(circ_buff_t *window, circ_buff_t *lookahead_buf,
-	lz_list_t *dict_table, int *pos, FILE *in)
+void lzss_compress_mt(FILE *in, FILE *out, int block_log, int flags,
+	int nthreads)
 {
-	add_entry(dict_table, lookahead_buf, window, *pos);
-	(*pos)++;
-	cb_push(window, cb_pop(lookahead_buf));
+	if (block_log == 0)
+		block_log = LZF_DEFAULT_LOG;
+	block_log = _LZ_MAX(LZF_MIN_LOG, _LZ_MIN(block_log, LZF_MAX_LOG));
+	flags &= LZSS_FRAME_PRIME;
+
+	size_t block = (size_t)1 << block_log;
+	size_t prime = (flags & LZSS_FRAME_PRIME) ? LZF_PRIME : 0;
+
+	zt_pool_t *pool = zt_create(nthreads);
+	int nslots = zt_size(pool);
+	lzf_block_t *slots = (lzf_block_t *)z_calloc((size_t)nslots,
+		sizeof(lzf_block_t));
+
+	// the chains reach over the primed bytes too
+	for (int i = 0; i < nslots; i++) {
+		lz2_encoder_init(&slots[i].enc, block_log + (prime ? 1 : 0),
+			block_log, 0);
+		slots[i].raw = (uint8_t *)z_malloc(prime + block);
+		slots[i].packed_cap = LZF_BOUND(block);
+		slots[i].packed = (uint8_t *)z_malloc(slots[i].packed_cap);
+	}
+
+	size_t nblocks = 0, cap = 64;
+	uint64_t *offsets = (uint64_t *)z_malloc(cap * sizeof(uint64_t));
+	uint64_t offset = LZF_HEADER, total = 0;
+	lzf_block_t *prev = NULL;
+	int done = 0;
+
+	uint8_t word[8] = LZF_MAGIC;
+	word[4] = (uint8_t)block_log;
+	word[5] = (uint8_t)flags;
+	(void)fwrite(word, 1, LZF_HEADER, out);
+
+	// read a block per thread, code them side by side, write them in order
+	while (!done) {
+		int batch = 0;
 
-	int next_byte = fgetc(in);
-	if (next_byte != EOF) {
-		cb_push(lookahead_buf, (uint8_t)next_byte);
+		while (batch < nslots && !done) {
+			lzf_block_t *b = &slots[batch];
+			prime_block(b, prev, prime);
+
+			size_t count;
+			b->raw_len = 0;
+			while (b->raw_len < block && (count = fread(b->raw + b->prime +
+				b->raw_len, 1, block - b->raw_len, in)) > 0)
+				b->raw_len += count;
+
+			done = b->raw_len < block;
+			if (b->raw_len > 0) {
+				zt_submit(pool, encode_block, b);
+				prev = b;
+				batch++;
+			}
+		}
+		zt_wait(pool);
+
+		for (int i = 0; i < batch; i++) {
+			if (nblocks + 1 >= cap) {
+				offsets = (uint64_t *)z_realloc(offsets,
+					cap * sizeof(uint64_t), 2 * cap * sizeof(uint64_t));
+				cap *= 2;
+			}
+			offsets[nblocks++] = offset;
+			(void)fwrite(slots[i].packed, 1, slots[i].packed_len, out);
+			offset += slots[i].packed_len;
+			total += slots[i].raw_len;
+		}
+	}
+
+	offsets[nblocks] = offset;
+	for (size_t i = 0; i <= nblocks; i++) {
+		lzf_put_le(word, offsets[i], 8);
+		(void)fwrite(word, 1, 8, out);
 	}
+	lzf_put_le(word, total, 8);
+	(void)fwrite(word, 1, 8, out);
+	lzf_put_le(word, nblocks, 4);
+	(void)fwrite(word, 1, 4, out);
+	(void)fwrite(LZF_INDEX_TAG, 1, 4, out);
+
+	// perform cleanup
+	for (int i = 0; i < nslots; i++) {
+		lz2_encoder_free(&slots[i].enc);
+		z_free(slots[i].raw);
+		z_free(slots[i].packed);
+	}
+	z_free(offsets);
+	z_free(slots);
+	zt_destroy(pool);
 }
 
-static int find_match(circ_buff_t *window, circ_buff_t *lookahead_buf,
-	lz_list_t *dict_table, int pos, int *dist, int *len)
+typedef struct {
+	long start;				// of the frame in the file
+	int block_log;
+	int flags;
+	size_t nblocks;
+	uint64_t size;			// of the data
+	uint64_t *offsets;		// of the blocks, then of the index
+} lzf_index_t;
+
+// Load the header and index of the frame at the current position of IN
+static int lzf_read_index(FILE *in, lzf_index_t *idx)
 {
-	int max_len = 2;
+	uint8_t header[LZF_HEADER], trailer[16];
 
-	*len = 0;
-	*dist = 0; 
+	idx->start = ftell(in);
+	if (idx->start < 0 || fseek(in, idx->start, SEEK_SET) != 0)
+		return FILE_ERROR;
 
-	uint8_t c1 = cb_get(lookahead_buf, 0);
-	uint8_t c2 = cb_get(lookahead_buf, 1);
+	if (fread(header, 1, LZF_HEADER, in) != LZF_HEADER ||
+		memcmp(header, LZF_MAGIC, 4) != 0 ||
+		header[4] < LZF_MIN_LOG || header[4] > LZF_MAX_LOG ||
+		(header[5] & ~LZSS_FRAME_PRIME))
+		return CORRUPT_ZLIB_HEADER;
+	idx->block_log = header[4];
+	idx->flags = header[5];
 
-	int dict_idx = (c1 << 8) + c2;
-	lz_list_t *list = &dict_table[dict_idx];
-	int mark_no = 0;
+	if (fseek(in, -16, SEEK_END) != 0 ||
+		fread(trailer, 1, 16, in) != 16 ||
+		memcmp(trailer + 12, LZF_INDEX_TAG, 4) != 0)
+		return INVALID_CHUNK_INDEX;
 
-	for (lz_node_t *node = list->head; node; node = node->next) {
-		// Localize potential match
+	long end = ftell(in);
+	idx->size = lzf_load_le(trailer, 8);
+	idx->nblocks = (size_t)lzf_load_le(trailer + 8, 4);
+	size_t index_size = (idx->nblocks + 1) * 8;
 
-		int global_pos = node->data;
-		int distance = pos - global_pos;
-		int i = 0;
+	// every block full but the last, which is not empty
+	uint64_t block = (uint64_t)1 << idx->block_log;
+	if (end < 0 || idx->nblocks != (idx->size + block - 1) / block ||
+		(uint64_t)(end - idx->start) < LZF_HEADER + index_size + 16 ||
+		fseek(in, end - 16 - (long)index_size, SEEK_SET) != 0)
+		return INVALID_CHUNK_INDEX;
 
-		// Calculate satisfactory length heuristic
+	uint8_t *raw = (uint8_t *)z_malloc(index_size);
+	idx->offsets = (uint64_t *)z_malloc(index_size);
+	int ok = fread(raw, 1, index_size, in) == index_size;
 
-		int heuristic = mark_no - MAX_MARKS;	// Assume MAX_MARKS == 256
-		heuristic *= heuristic * 7;
-		heuristic >>= 11;
-		heuristic += 32;
+	for (size_t i = 0; ok && i <= idx->nblocks; i++) {
+		idx->offsets[i] = lzf_load_le(raw + 8 * i, 8);
+		ok = i ? idx->offsets[i] > idx->offsets[i - 1] :
+			idx->offsets[0] == LZF_HEADER;
+	}
+	ok = ok && idx->offsets[idx->nblocks] + index_size + 16 ==
+		(uint64_t)(end - idx->start);
+	z_free(raw);
 
-		// Calculate match length
+	if (!ok) {
+		z_free(idx->offsets);
+		return INVALID_CHUNK_INDEX;
+	}
+	return Z_OK;
+}
 
-		while (i < (int)cb_get_size(lookahead_buf)) {
-			// indexing in sliding window is done with dist - 1
+// Where decoded blocks go: all of them to OUT, or the LEN bytes of the data
+// from FROM on to DST
+typedef struct {
+	FILE *out;
+	uint8_t *dst;
+	uint64_t from;
+	size_t len;
+} lzf_sink_t;
 
-			uint8_t next_in_stream = cb_get(lookahead_buf, i);
-			int win_idx = distance - 1 - i;
-			uint8_t next_in_win;
+static void lzf_deliver(lzf_sink_t *sink, const lzf_block_t *b,
+	uint64_t at)
+{
+	const uint8_t *data = b->raw + b->prime;
 
-			if (win_idx >= 0) {
-				next_in_win = cb_get_from_back(window, win_idx);
-			} else {
-				next_in_win = cb_get(lookahead_buf, -(win_idx + 1));
-			}
+	if (sink->out) {
+		(void)fwrite(data, 1, b->raw_len, sink->out);
+		return;
+	}
 
-			if (next_in_stream != next_in_win)
-				break;
+	uint64_t lo = _LZ_MAX(at, sink->from);
+	uint64_t hi = _LZ_MIN(at + b->raw_len, sink->from + sink->len);
+	if (lo < hi)
+		memcpy(sink->dst + (lo - sink->from), data + (lo - at),
+			(size_t)(hi - lo));
+}
+
+// Decode blocks FIRST to LAST - 1 to SINK. Primed blocks need the one
+// before decoded, they go one at a time.
+static int lzf_decode(FILE *in, const lzf_index_t *idx, size_t first,
+	size_t last, int nthreads, lzf_sink_t *sink)
+{
+	size_t block = (size_t)1 << idx->block_log;
+	size_t prime = (idx->flags & LZSS_FRAME_PRIME) ? LZF_PRIME : 0;
+
+	zt_pool_t *pool = zt_create(prime ? 1 : nthreads);
+	int nslots = zt_size(pool);
+	lzf_block_t *slots = (lzf_block_t *)z_calloc((size_t)nslots,
+		sizeof(lzf_block_t));
+
+	// room for copy_match to run past the block
+	for (int i = 0; i < nslots; i++)
+		slots[i].raw = (uint8_t *)z_malloc(prime + block + 8);
+
+	// blocks are contiguous, one seek to the first is enough
+	int ret = Z_OK;
+	if (fseek(in, idx->start + (long)idx->offsets[first], SEEK_SET) != 0)
+		ret = FILE_ERROR;
 
-			if (i + 1 > max_len) {
-				max_len = i + 1;
-				*len = i + 1;
-				*dist = distance;
+	lzf_block_t *prev = NULL;
+	for (size_t next = first; ret == Z_OK && next < last; ) {
+		size_t batch_first = next;
+		int batch = 0;
+
+		for (; batch < nslots && next < last; batch++, next++) {
+			lzf_block_t *b = &slots[batch];
+			size_t len = (size_t)(idx->offsets[next + 1] -
+				idx->offsets[next]);
+
+			if (len > LZF_BOUND(block)) {
+				ret = CORRUPT_CHUNK;
+				break;
 			}
-			if (*len == 258) {
-				return 1;
+			if (len > b->packed_cap) {
+				z_free(b->packed);
+				b->packed_cap = len;
+				b->packed = (uint8_t *)z_malloc(b->packed_cap);
+			}
+			if (fread(b->packed, 1, len, in) != len) {
+				ret = STREAM_TOO_SHORT;
+				break;
 			}
-			i++;
+			b->packed_len = len;
+
+			prime_block(b, prev, prime);
+			b->raw_len = (size_t)_LZ_MIN(block,
+				idx->size - ((uint64_t)next << idx->block_log));
+			zt_submit(pool, decode_block, b);
+			prev = b;
 		}
-		if (*len >= heuristic) {
-			return 1;
+		zt_wait(pool);
+
+		for (int i = 0; i < batch; i++) {
+			if (slots[i].err != Z_OK) {
+				ret = slots[i].err;
+				break;
+			}
+			lzf_deliver(sink, &slots[i],
+				(uint64_t)(batch_first + (size_t)i) << idx->block_log);
 		}
-		mark_no++;
 	}
-	if (*len >= 3) {
-		return 1;
+
+	// perform cleanup
+	for (int i = 0; i < nslots; i++) {
+		z_free(slots[i].raw);
+		z_free(slots[i].packed);
 	}
+	z_free(slots);
+	zt_destroy(pool);
 
-	return 0;
+	return ret;
+}
+
+int lzss_decompress_mt(FILE *in, FILE *out, int nthreads)
+{
+	lzf_index_t idx;
+	int ret = lzf_read_index(in, &idx);
+	if (ret != Z_OK)
+		return ret;
+
+	lzf_sink_t sink = {out, NULL, 0, 0};
+	ret = lzf_decode(in, &idx, 0, idx.nblocks, nthreads, &sink);
+
+	z_free(idx.offsets);
+	return ret;
+}
+
+int lzss_read_at(FILE *in, uint64_t offset, size_t len, uint8_t *dst,
+	size_t *nread)
+{
+	lzf_index_t idx;
+	int ret = lzf_read_index(in, &idx);
+
+	*nread = 0;
+	if (ret != Z_OK)
+		return ret;
+
+	if (offset < idx.size && len > 0) {
+		len = (size_t)_LZ_MIN(len, idx.size - offset);
+
+		// primed blocks depend on all the ones before
+		size_t first = (size_t)(offset >> idx.block_log);
+		size_t last = (size_t)((offset + len - 1) >> idx.block_log) + 1;
+		if (idx.flags & LZSS_FRAME_PRIME)
+			first = 0;
+
+		lzf_sink_t sink = {NULL, dst, offset, len};
+		ret = lzf_decode(in, &idx, first, last, 0, &sink);
+		if (ret == Z_OK)
+			*nread = len;
+	}
+
+	// ready for the next read
+	if (fseek(in, idx.start, SEEK_SET) != 0 && ret == Z_OK)
+		ret = FILE_ERROR;
+	z_free(idx.offsets);
+	return ret;
 }
@@ -2,9 +2,66 @@
 #define _LZSS_H 1
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*	Levels of lzss_compress_level  */
+#define LZSS_LEVEL_FAST 1		// greedy, what lzss_compress does
+#define LZSS_LEVEL_OPTIMAL 2	// cheapest parse in bits, about 10x slower
 
 void lzss_compress(FILE *in, FILE *out);
 
+/*	Same format as lzss_compress, parsed at LEVEL. The optimal level
+	searches a match at every position, not just where a token starts: it
+	runs 6 to 11 times slower than greedy for output 1 to 6% smaller, so it
+	suits data compressed once and read often.  */
+void lzss_compress_level(FILE *in, FILE *out, int level);
+
 void lzss_decompress(FILE *in, FILE *out);
 
+/*	Format v2: a header with the window size, windows of 1 << WINDOW_LOG
+	bytes (15 to 24, 0 for the default of 4MB), varint lengths and
+	distances, and an end marker followed by the adler32 of the data.  */
+void lzss2_compress(FILE *in, FILE *out, int window_log);
+
+/*	Flags of lzss2_compress_flags  */
+#define LZSS2_F_LDM 0x1		// long-distance matching, see below
+#define LZSS2_F_DEEP 0x2	// search as deep as v1, 2 to 4.5x slower
+
+/*	Same as lzss2_compress, with the LZSS2_F_* FLAGS. With LZSS2_F_LDM,
+	long repeats anywhere in the window are found through content-defined
+	anchors, at close to memcpy speed, while the hash chains only search the
+	last 64KB. Suits large windows over data with duplicated regions.
+	By default the chains are searched 48 deep, a fifth of what v1 does:
+	on text with only short-range repeats the output can be up to 20%
+	larger than v1's. LZSS2_F_DEEP searches 256 deep, for v1's ratio or better.  */
+void lzss2_compress_flags(FILE *in, FILE *out, int window_log, int flags);
+
+/*	Returns Z_OK or a code of zerrcodes.h, after writing out what could be
+	decoded.  */
+int lzss2_decompress(FILE *in, FILE *out);
+
+/*	Flags of lzss_compress_mt  */
+#define LZSS_FRAME_PRIME 0x1	// blocks may match the last 64KB of the one
+								// before, which then has to be decoded first
+
+/*	Frame of independent v2 blocks of 1 << BLOCK_LOG bytes (16 to 26, 0 for
+	the default of 1MB), coded on NTHREADS threads (one per CPU if <= 0),
+	with an index of the blocks at the end.  */
+void lzss_compress_mt(FILE *in, FILE *out, int block_log, int flags,
+	int nthreads);
+
+/*	Decode the frame at the current position of IN, which must be
+	seekable, on NTHREADS threads. Primed frames decode on a single one.
+	Returns Z_OK or a code of zerrcodes.h.  */
+int lzss_decompress_mt(FILE *in, FILE *out, int nthreads);
+
+/*	Decode the LEN bytes of data from OFFSET on of the frame at the current
+	position of IN to DST, going through the index to the blocks holding
+	them only. Sets *NREAD to the bytes read, fewer past the end of the
+	data, and leaves IN at the frame. Returns Z_OK or a code of
+	zerrcodes.h.  */
+int lzss_read_at(FILE *in, uint64_t offset, size_t len, uint8_t *dst,
+	size_t *nread);
+
 #endif  // _LZSS_H
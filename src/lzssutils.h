@@ -8,12 +8,21 @@
 #define DMOD(x, y) ((x) - (y) * FLOOR((double)(x) / (y)))	// double mod
 #define IMOD(x, y) ((((x) % (y)) < 0) * (y) + ((x) % (y)))	// int mod
 
+/*	Ring of the last CAPACITY bytes pushed, a power of two so that indices
+	wrap with MASK. Once full, each push drops the oldest byte.  */
 typedef struct circ_buff_t {
 	unsigned char *buffer;
 	size_t capacity, size;
+	size_t mask;					// capacity - 1
 	size_t read_idx, write_idx;
 } circ_buff_t;
 
+/*	A run of bytes contiguous in the ring  */
+typedef struct cb_span_t {
+	const unsigned char *ptr;
+	size_t len;
+} cb_span_t;
+
 circ_buff_t *cb_create(size_t capacity);
 
 void cb_destroy(circ_buff_t *cb);
@@ -26,63 +35,23 @@ size_t cb_get_size(circ_buff_t *cb);
 
 void cb_push(circ_buff_t *cb, unsigned char val);
 
-unsigned char cb_pop(circ_buff_t *cb);
-
-unsigned char cb_get(circ_buff_t *cb, int idx);
-
-unsigned char cb_get_from_back(circ_buff_t *cb, int idx);
-
-typedef struct lz_node_t {
-	struct lz_node_t *next, *prev;
-	int data;
-} lz_node_t;
-
-typedef struct lz_list_t {
-	lz_node_t *head, *tail;
-	int size;
-} lz_list_t;
-
-lz_list_t *lzl_create();
-
-void lzl_clear(lz_list_t *list);
-
-void lzl_destroy(lz_list_t *list);
-
-void lzl_insert(lz_list_t *list, int idx, int val);
-
-int lzl_extract(lz_list_t *list, int idx);
+/*	Push the N bytes of DATA, in at most two copies.  */
+void cb_push_n(circ_buff_t *cb, const unsigned char *data, size_t n);
 
-int lzl_get(lz_list_t *list, int idx);
+/*	Push LEN bytes copied from DIST bytes back, 1 <= DIST <= size, as an
+	LZ77 match: a DIST shorter than LEN repeats the last DIST bytes. They
+	are also written to DST unless it is NULL.  */
+void cb_copy_match(circ_buff_t *cb, size_t dist, size_t len,
+	unsigned char *dst);
 
-void lzl_push_front(lz_list_t *list, int val);
+/*	The LEN bytes from DIST bytes back, LEN <= DIST <= size, as one or two
+	spans in SPANS. Returns the number of spans.  */
+int cb_spans(circ_buff_t *cb, size_t dist, size_t len, cb_span_t spans[2]);
 
-void lzl_push_back(lz_list_t *list, int val);
-
-int lzl_pop_front(lz_list_t *list);
-
-int lzl_pop_back(lz_list_t *list);
-
-#define BL_ARR_DEFAULT_CAPACITY 32
-
-typedef struct backlink_array_t {
-	size_t size, capacity;
-	int *pos;
-	unsigned short *dist;
-	unsigned char *len;
-} backlink_array_t;
-
-backlink_array_t *bl_arr_create();
-
-void bl_arr_destroy(backlink_array_t *arr);
-
-void bl_arr_expand(backlink_array_t *arr);
-
-void bl_arr_push(backlink_array_t *arr, int pos, int dist, int len);
-
-int bl_arr_get(backlink_array_t *arr, int idx, int *pos, int *dist, int *len);
+unsigned char cb_pop(circ_buff_t *cb);
 
-void bl_arr_reset(backlink_array_t *arr);
+unsigned char cb_get(circ_buff_t *cb, int idx);
 
-size_t bl_arr_size(backlink_array_t *arr);
+unsigned char cb_get_from_back(circ_buff_t *cb, int idx);
 
 #endif  // _LZSSUTILS_H
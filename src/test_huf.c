@@ -1,15 +1,142 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "lzss.h"
+#include "deflate.h"
+#include "inflate.h"
+#include "zerrcodes.h"
 #include <assert.h>
 
+static void same_files(FILE *a, FILE *b)
+{
+	unsigned char x[4096], y[4096];
+	size_t n;
+
+	rewind(a);
+	rewind(b);
+	do {
+		n = fread(x, 1, sizeof(x), a);
+		assert(fread(y, 1, sizeof(y), b) == n);
+		assert(memcmp(x, y, n) == 0);
+	} while (n);
+}
+
+// Parse IN, save and load the parse, then emit it with every strategy and
+// inflate it back to IN. A parse reaching before the start or not adding
+// up to its size has to be rejected.
+static void test_parse(FILE *in)
+{
+	deflate_parse_t parse, loaded;
+	FILE *tmp = tmpfile();
+
+	assert(tmp);
+	assert(deflate_parse(in, &parse) == Z_OK);
+	assert(deflate_parse_save(&parse, tmp) == Z_OK);
+	rewind(tmp);
+	assert(deflate_parse_load(&loaded, tmp) == Z_OK);
+	assert(loaded.count == parse.count && loaded.size == parse.size);
+	assert(loaded.adler == parse.adler);
+	assert(!parse.count ||
+		memcmp(loaded.tokens, parse.tokens, 4 * parse.count) == 0);
+	fclose(tmp);
+
+	for (int s = DEFLATE_EMIT_FIXED; s <= DEFLATE_EMIT_SPLIT; s++) {
+		FILE *z = tmpfile();
+		FILE *back = tmpfile();
+
+		assert(z && back);
+		assert(deflate_emit(&loaded, s, z) == Z_OK);
+		rewind(z);
+		assert(inflate(z, back) == Z_OK);
+		same_files(in, back);
+		fclose(z);
+		fclose(back);
+	}
+
+	FILE *null = tmpfile();
+
+	assert(null);
+	loaded.size++;
+	assert(deflate_emit(&loaded, DEFLATE_EMIT_DYNAMIC, null) == INVALID_PARSE);
+	deflate_parse_free(&loaded);
+	deflate_parse_free(&parse);
+
+	deflate_parse_init(&parse);
+	deflate_parse_push(&parse, 'a');
+	deflate_parse_push(&parse, deflate_token(3, 2));
+	assert(deflate_emit(&parse, DEFLATE_EMIT_FIXED, null) == INVALID_PARSE);
+	deflate_parse_free(&parse);
+
+	unsigned char header[24] = "DPAX";
+
+	rewind(null);
+	assert(fwrite(header, 1, sizeof(header), null) == sizeof(header));
+	rewind(null);
+	assert(deflate_parse_load(&parse, null) == INVALID_PARSE);
+	fclose(null);
+}
+
+// Frame IN in 64KB blocks, primed or not, and read ranges across the block
+// boundaries back with lzss_read_at, then one running past the end.
+static void test_read_at(FILE *in, int flags)
+{
+	size_t size;
+	uint8_t *data, *got;
+	FILE *frame = tmpfile();
+
+	assert(frame);
+	assert(fseek(in, 0, SEEK_END) == 0);
+	size = (size_t)ftell(in);
+	rewind(in);
+	data = malloc(size + 1);
+	got = malloc(size + 1);
+	assert(data && got);
+	assert(fread(data, 1, size, in) == size);
+	rewind(in);
+
+	lzss_compress_mt(in, frame, 16, flags, 2);
+
+	for (size_t b = 1 << 16; b < size; b += 1 << 16) {
+		size_t from = b - 1000;
+		size_t len = b + 1000 > size ? size - from : 2000;
+		size_t n;
+
+		rewind(frame);
+		assert(lzss_read_at(frame, from, len, got, &n) == Z_OK);
+		assert(n == len && memcmp(got, data + from, len) == 0);
+	}
+
+	size_t from = size / 3, n;
+
+	rewind(frame);
+	assert(lzss_read_at(frame, from, size, got, &n) == Z_OK);
+	assert(n == size - from && memcmp(got, data + from, n) == 0);
+	free(data);
+	free(got);
+	fclose(frame);
+}
+
 int main(int argc, char **argv)
 {
 	if (argc != 2)
 		return -1;
 	FILE *in = fopen("lz.out", "rb");
-	FILE *out = fopen("lz.ref", "wb");
 
 	assert(in);
+
+	if (*argv[1] == 'p' || *argv[1] == 'r') {
+		if (*argv[1] == 'p')
+			test_parse(in);
+		else {
+			test_read_at(in, 0);
+			test_read_at(in, LZSS_FRAME_PRIME);
+		}
+		fclose(in);
+		return 0;
+	}
+
+	FILE *out = fopen("lz.ref", "wb");
+
 	assert(out);
 
 	if (*argv[1] == 'd')
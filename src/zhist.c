@@ -0,0 +1,113 @@
+#include "zhist.h"
+#include <string.h>
+
+#define ZH_LOG_FRAC 16			// fraction bits of zh_log2
+
+static void count_direct(const uint8_t *data, size_t n, int *hist)
+{
+	for (size_t i = 0; i < n; i++)
+		hist[data[i]]++;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+	// byte order does not matter, every byte is counted once
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+#define COUNT_WORD(word)\
+	do {\
+		sub[0][(word) & 0xff]++;\
+		sub[1][(word) >> 8 & 0xff]++;\
+		sub[2][(word) >> 16 & 0xff]++;\
+		sub[3][(word) >> 24 & 0xff]++;\
+		sub[0][(word) >> 32 & 0xff]++;\
+		sub[1][(word) >> 40 & 0xff]++;\
+		sub[2][(word) >> 48 & 0xff]++;\
+		sub[3][(word) >> 56]++;\
+	} while (0)
+
+void zh_count(const uint8_t *data, size_t n, int *hist)
+{
+	// not worth clearing and merging the sub-tables
+	if (n < ZH_MIN_BULK) {
+		count_direct(data, n, hist);
+		return;
+	}
+
+	uint32_t sub[ZH_TABLES][256];
+	memset(sub, 0, sizeof(sub));
+
+	// two words per round, loaded ahead of the increments
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint64_t w0 = load64(data + i);
+		uint64_t w1 = load64(data + i + 8);
+		COUNT_WORD(w0);
+		COUNT_WORD(w1);
+	}
+	for (; i < n; i++)
+		sub[i & (ZH_TABLES - 1)][data[i]]++;
+
+	for (int c = 0; c < 256; c++)
+		hist[c] += (int)(sub[0][c] + sub[1][c] + sub[2][c] + sub[3][c]);
+}
+
+#undef COUNT_WORD
+
+size_t zh_sample(const uint8_t *data, size_t n, int *hist, int shift)
+{
+	size_t stride = (size_t)ZH_SAMPLE_RUN << shift;
+	size_t counted = 0;
+
+	for (size_t off = 0; off < n; off += stride) {
+		size_t run = n - off < ZH_SAMPLE_RUN ? n - off : ZH_SAMPLE_RUN;
+		count_direct(data + off, run, hist);
+		counted += run;
+	}
+
+	return counted;
+}
+
+// log2(X) for X > 0, with ZH_LOG_FRAC fraction bits
+static uint64_t zh_log2(uint64_t x)
+{
+	// integer part, then normalise X to [1, 2) with 31 fraction bits
+	int e = 0;
+	while (x >> (e + 1))
+		e++;
+
+	uint64_t result = (uint64_t)e << ZH_LOG_FRAC;
+	uint64_t m = e > 31 ? x >> (e - 31) : x << (31 - e);
+
+	// each squaring of the mantissa yields the next fraction bit
+	for (int b = ZH_LOG_FRAC - 1; b >= 0; b--) {
+		m = (m * m) >> 31;
+		if (m >= (uint64_t)2 << 31) {
+			m >>= 1;
+			result |= (uint64_t)1 << b;
+		}
+	}
+
+	return result;
+}
+
+uint64_t zh_cost(const int *hist, int nsyms)
+{
+	uint64_t total = 0;
+	for (int c = 0; c < nsyms; c++)
+		total += (uint64_t)hist[c];
+	if (total == 0)
+		return 0;
+
+	// sum of count * log2(total / count)
+	uint64_t log_total = zh_log2(total), bits = 0;
+	for (int c = 0; c < nsyms; c++) {
+		if (hist[c] > 0)
+			bits += (uint64_t)hist[c] * (log_total - zh_log2((uint64_t)hist[c]));
+	}
+
+	return bits >> ZH_LOG_FRAC;
+}
@@ -0,0 +1,25 @@
+#ifndef _ZHIST_H
+#define _ZHIST_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZH_TABLES 4				// interleaved sub-tables of zh_count
+#define ZH_MIN_BULK 1024		// shorter inputs are counted directly
+#define ZH_SAMPLE_RUN 64		// bytes counted per sampled stride
+
+/*	Add the byte counts of N bytes of DATA to HIST[256]. Counts go to
+	ZH_TABLES sub-tables in turn, so a run of one byte does not wait on a
+	single counter, and are summed at the end.  */
+void zh_count(const uint8_t *data, size_t n, int *hist);
+
+/*	Like zh_count, but only the first ZH_SAMPLE_RUN bytes of every
+	ZH_SAMPLE_RUN << SHIFT are counted. Returns the number of bytes counted.  */
+size_t zh_sample(const uint8_t *data, size_t n, int *hist, int shift);
+
+/*	Size in bits of the NSYMS symbols counted in HIST under an ideal
+	entropy coder, a lower bound for any huffman code. Fixed point, the
+	error stays below a bit per thousand symbols.  */
+uint64_t zh_cost(const int *hist, int nsyms);
+
+#endif  // _ZHIST_H
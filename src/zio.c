@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include "zio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* FILE source */
+
+static long file_read(void *opaque, unsigned char *buf, size_t len)
+{
+	zio_file_t *file = (zio_file_t *)opaque;
+	size_t count = fread(buf, 1, len, file->src);
+
+	if (ferror(file->src))
+		return -1;
+
+	return (long)count;
+}
+
+static const unsigned char *file_view(void *opaque, size_t *len)
+{
+	zio_file_t *file = (zio_file_t *)opaque;
+	struct stat st;
+	int fd = fileno(file->src);
+
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	off_t start = ftello(file->src);
+	if (start < 0 || st.st_size - start < ZIO_MAP_THRESHOLD)
+		return NULL;
+
+	/* mmap offsets must be page aligned, map from the page holding START */
+
+	off_t page = (off_t)sysconf(_SC_PAGESIZE);
+	off_t map_start = start - start % page;
+	size_t map_size = (size_t)(st.st_size - map_start);
+
+	void *base = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, map_start);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	(void)madvise(base, map_size, MADV_SEQUENTIAL);
+
+	file->map_base = base;
+	file->map_size = map_size;
+	file->map = (unsigned char *)base + (start - map_start);
+	file->map_len = (size_t)(st.st_size - start);
+	file->src_start = start;
+
+	*len = file->map_len;
+	return file->map;
+}
+
+/* FILE sink */
+
+static void file_open_output(zio_file_t *file)
+{
+	struct stat st;
+	int fd = fileno(file->dest);
+
+	if (fd < 0 || fstat(fd, &st) != 0)
+		return;
+
+	/* Anything already buffered by stdio must land before our writes */
+
+	if (fflush(file->dest) != 0)
+		return;
+
+	file->out_fd = fd;
+
+	if (!S_ISREG(st.st_mode))
+		return;
+
+	off_t off = ftello(file->dest);
+	if (off < 0)
+		return;
+
+	file->out_seekable = 1;
+	file->out_off = off;
+	file->out_reserved = off;
+	file->out_orig_size = st.st_size;
+}
+
+static void file_reserve(zio_file_t *file, size_t size)
+{
+	if (!file->out_seekable || file->out_off + (off_t)size <= file->out_reserved)
+		return;
+
+	off_t len = file->out_off + (off_t)size - file->out_reserved;
+
+	/* KEEP_SIZE: the file only grows as data is actually written */
+
+	if (fallocate(file->out_fd, FALLOC_FL_KEEP_SIZE, file->out_reserved, len)
+		== 0)
+		file->out_reserved += len;
+}
+
+static int file_writev(void *opaque, const z_iovec *iov, int iovcnt)
+{
+	zio_file_t *file = (zio_file_t *)opaque;
+	struct iovec vec[ZIO_MAX_IOV];
+	size_t total = 0;
+	int cnt = 0;
+	int i = 0;
+
+	for (; i < iovcnt && cnt < ZIO_MAX_IOV; i++) {
+		if (iov[i].len == 0)
+			continue;
+		vec[cnt].iov_base = (void *)iov[i].base;
+		vec[cnt].iov_len = iov[i].len;
+		total += iov[i].len;
+		cnt++;
+	}
+
+	/* Too many pieces, the rest goes out in further batches */
+
+	int rest = iovcnt - i;
+
+	if (file->out_fd < 0) {
+		for (int j = 0; j < cnt; j++)
+			(void)fwrite(vec[j].iov_base, 1, vec[j].iov_len, file->dest);
+		if (ferror(file->dest))
+			return -1;
+		return rest ? file_writev(opaque, iov + i, rest) : 0;
+	}
+
+	if (file->out_seekable && file->out_off + (off_t)total > file->out_reserved)
+		file_reserve(file, total > ZIO_PREALLOC_STEP ? total : ZIO_PREALLOC_STEP);
+
+	struct iovec *next = vec;
+	while (cnt) {
+		ssize_t written = file->out_seekable ?
+			pwritev(file->out_fd, next, cnt, file->out_off) :
+			writev(file->out_fd, next, cnt);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return -1;
+
+		file->out_off += written;
+
+		/* Skip what went out, partial writes may stop mid-buffer */
+
+		size_t done = (size_t)written;
+		while (cnt && done >= next->iov_len) {
+			done -= next->iov_len;
+			next++;
+			cnt--;
+		}
+		if (cnt) {
+			next->iov_base = (char *)next->iov_base + done;
+			next->iov_len -= done;
+		}
+	}
+
+	return rest ? file_writev(opaque, iov + i, rest) : 0;
+}
+
+static int file_write(void *opaque, const unsigned char *buf, size_t len)
+{
+	z_iovec iov = {buf, len};
+	return file_writev(opaque, &iov, 1);
+}
+
+static void file_finish(zio_file_t *file, size_t consumed)
+{
+	if (file->map_base) {
+		(void)munmap(file->map_base, file->map_size);
+		(void)fseeko(file->src, file->src_start + (off_t)consumed, SEEK_SET);
+		file->map_base = NULL;
+		file->map = NULL;
+	}
+
+	if (file->out_seekable) {
+		/* Give back the unused part of the reservation and move the FILE
+		past the data written behind its back. The file ends at KEEP,
+		past its old end only if written there; truncating to it frees
+		the reserved blocks beyond, which a hole punched past the end
+		would not do on every filesystem, and leaves the old contents
+		after OUT_OFF alone, as a plain write would */
+
+		off_t keep = file->out_off > file->out_orig_size ?
+			file->out_off : file->out_orig_size;
+
+		if (file->out_reserved > keep)
+			(void)ftruncate(file->out_fd, keep);
+		(void)fseeko(file->dest, file->out_off, SEEK_SET);
+		file->out_seekable = 0;
+	}
+}
+
+/* Front end */
+
+void zio_init(z_io_t *io, const z_source *src, const z_sink *dest)
+{
+	io->is_file = 0;
+	io->map = NULL;
+	io->map_len = 0;
+	io->peek = -1;
+	io->error = 0;
+
+	if (src) {
+		io->src = *src;
+		if (src->view) {
+			size_t len = 0;
+			const unsigned char *view = src->view(src->opaque, &len);
+
+			/* Codecs never write through IN, the cast only spares them a
+			separate const pointer */
+
+			io->map = (unsigned char *)view;
+			io->map_len = view ? len : 0;
+		}
+	}
+	if (dest)
+		io->dest = *dest;
+}
+
+void zio_init_file(z_io_t *io, FILE *src, FILE *dest)
+{
+	zio_file_t *file = &io->file;
+
+	file->src = src;
+	file->dest = dest;
+	file->map_base = NULL;
+	file->map_size = 0;
+	file->map = NULL;
+	file->map_len = 0;
+	file->src_start = 0;
+	file->out_fd = -1;
+	file->out_seekable = 0;
+	file->out_off = 0;
+	file->out_reserved = 0;
+	file->out_orig_size = 0;
+
+	if (dest)
+		file_open_output(file);
+
+	z_source source = {file, file_read, file_view};
+	z_sink sink = {file, file_write, file_writev};
+
+	zio_init(io, src ? &source : NULL, dest ? &sink : NULL);
+	io->is_file = 1;
+}
+
+void zio_finish(z_io_t *io, size_t consumed)
+{
+	if (io->is_file)
+		file_finish(&io->file, consumed);
+	io->map = NULL;
+}
+
+void zio_reserve(z_io_t *io, size_t size)
+{
+	if (io->is_file && io->file.out_fd >= 0)
+		file_reserve(&io->file, size);
+}
+
+long zio_read(z_io_t *io, unsigned char *buf, size_t len)
+{
+	size_t count = 0;
+
+	if (io->peek >= 0 && len) {
+		buf[count++] = (unsigned char)io->peek;
+		io->peek = -1;
+	}
+
+	while (count < len) {
+		long res = io->src.read(io->src.opaque, buf + count, len - count);
+
+		if (res < 0) {
+			io->error = 1;
+			return -1;
+		}
+		if (res == 0)
+			break;
+		count += (size_t)res;
+	}
+
+	return (long)count;
+}
+
+int zio_eof(z_io_t *io)
+{
+	/* Read one byte ahead and hand it out with the next read */
+
+	if (io->peek >= 0)
+		return 0;
+
+	unsigned char byte;
+	long res = io->src.read(io->src.opaque, &byte, 1);
+
+	if (res <= 0) {
+		if (res < 0)
+			io->error = 1;
+		return 1;
+	}
+
+	io->peek = byte;
+	return 0;
+}
+
+int zio_write(z_io_t *io, const unsigned char *buf, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	if (io->dest.write(io->dest.opaque, buf, len) != 0) {
+		io->error = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int zio_writev(z_io_t *io, const z_iovec *iov, int iovcnt)
+{
+	if (io->dest.writev) {
+		if (io->dest.writev(io->dest.opaque, iov, iovcnt) != 0) {
+			io->error = 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (zio_write(io, iov[i].base, iov[i].len) != 0)
+			return -1;
+	}
+
+	return 0;
+}
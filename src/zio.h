@@ -0,0 +1,76 @@
+#ifndef _ZIO_H
+#define _ZIO_H 1
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "zstream.h"
+
+#define ZIO_MAP_THRESHOLD (1 << 16)		// smaller files go through stdio
+#define ZIO_PREALLOC_STEP (1 << 24)		// 16MB of output reserved at a time
+#define ZIO_MAX_IOV 16
+
+/*	State of the FILE backed source and sink. Regular input files are mapped
+	whole (MADV_SEQUENTIAL) and offered through z_source.view; regular output
+	files are written with pwrite behind fallocate reservations, other
+	descriptors with write(2). Pipes and small files are read with stdio.  */
+typedef struct zio_file_t {
+	FILE *src;
+	FILE *dest;
+
+	void *map_base;				// page aligned address returned by mmap
+	size_t map_size;
+	unsigned char *map;			// first unread byte at open time
+	size_t map_len;
+	off_t src_start;			// file offset of MAP
+
+	int out_fd;					// -1 to go through fwrite
+	int out_seekable;			// pwrite at OUT_OFF rather than write
+	off_t out_off;				// next byte to write
+	off_t out_reserved;			// end of the fallocate'd region
+	off_t out_orig_size;
+} zio_file_t;
+
+/*	IO front end of the zlib engines. Reads and writes go through the
+	source/sink callbacks; a source exposing a view is processed in place
+	(MAP), without any copy.  */
+typedef struct z_io_t {
+	z_source src;
+	z_sink dest;
+	zio_file_t file;			// backs SRC and DEST when IS_FILE
+	int is_file;
+
+	unsigned char *map;			// input view, NULL when streaming
+	size_t map_len;
+
+	int peek;					// byte read ahead by zio_eof, or -1
+	int error;
+} z_io_t;
+
+/*	Set up IO over caller supplied callbacks.  */
+void zio_init(z_io_t *io, const z_source *src, const z_sink *dest);
+
+/*	Set up IO for SRC and DEST through the built-in FILE source and sink.  */
+void zio_init_file(z_io_t *io, FILE *src, FILE *dest);
+
+/*	Release the view and, for FILEs, leave both positioned right after the
+	data consumed and produced. CONSUMED is the number of viewed bytes used.  */
+void zio_finish(z_io_t *io, size_t consumed);
+
+/*	Reserve SIZE more bytes of output space ahead of the current offset.  */
+void zio_reserve(z_io_t *io, size_t size);
+
+/*	Streaming read into BUF, retrying short reads until LEN bytes arrive or
+	the input ends. Returns the number of bytes read, or -1 on error.  */
+long zio_read(z_io_t *io, unsigned char *buf, size_t len);
+
+/*	Returns 1 if the streaming source has no more data.  */
+int zio_eof(z_io_t *io);
+
+/*	Write LEN bytes of BUF to the destination. Returns 0 on success.  */
+int zio_write(z_io_t *io, const unsigned char *buf, size_t len);
+
+/*	Write IOVCNT buffers in order. Returns 0 on success.  */
+int zio_writev(z_io_t *io, const z_iovec *iov, int iovcnt);
+
+#endif  // _ZIO_H
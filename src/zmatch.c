@@ -0,0 +1,137 @@
+#include "zmatch.h"
+#include <string.h>
+#include "zmem.h"
+
+void zm_init(zm_finder_t *mf, const zm_params_t *params)
+{
+	mf->params = *params;
+
+	// about two window positions per bucket, more would be mostly
+	// collisions to walk through
+	mf->hash_log = params->window_log - 1;
+	if (mf->hash_log > ZM_MAX_HASH_LOG)
+		mf->hash_log = ZM_MAX_HASH_LOG;
+	if (params->hash_bytes == 2)
+		mf->hash_log = 16;
+	mf->head = (uint32_t *)z_calloc((size_t)1 << mf->hash_log,
+		sizeof(uint32_t));
+	mf->prev = (uint32_t *)z_malloc(sizeof(uint32_t) << params->window_log);
+	mf->mask = ((uint32_t)1 << params->window_log) - 1;
+}
+
+void zm_free(zm_finder_t *mf)
+{
+	z_free(mf->prev);
+	z_free(mf->head);
+}
+
+void zm_reset(zm_finder_t *mf)
+{
+	memset(mf->head, 0, sizeof(uint32_t) << mf->hash_log);
+}
+
+// Two bytes index the table directly, more are hashed
+static inline uint32_t zm_hash(const zm_finder_t *mf, const uint8_t *p)
+{
+	uint32_t word = (uint32_t)p[0] | (uint32_t)p[1] << 8;
+
+	if (mf->params.hash_bytes == 2)
+		return word;
+
+	word |= (uint32_t)p[2] << 16;
+	if (mf->params.hash_bytes == 4)
+		word |= (uint32_t)p[3] << 24;
+	else
+		word <<= 8;
+	return (word * 2654435761u) >> (32 - mf->hash_log);
+}
+
+void zm_insert(zm_finder_t *mf, const uint8_t *p, size_t n, size_t ahead,
+	uint32_t pos)
+{
+	size_t hash_bytes = (size_t)mf->params.hash_bytes;
+
+	if (ahead < hash_bytes)
+		return;
+	if (n > ahead - hash_bytes + 1)
+		n = ahead - hash_bytes + 1;
+
+	for (size_t i = 0; i < n; i++) {
+		uint32_t h = zm_hash(mf, p + i);
+		mf->prev[(pos + i) & mf->mask] = mf->head[h];
+		mf->head[h] = pos + (uint32_t)i + 1;
+	}
+}
+
+// A word at a time while they agree
+uint32_t zm_match_len(const uint8_t *a, const uint8_t *b,
+	uint32_t limit)
+{
+	uint32_t len = 0;
+
+	while (len + 8 <= limit) {
+		uint64_t wa, wb;
+		memcpy(&wa, a + len, 8);
+		memcpy(&wb, b + len, 8);
+		if (wa != wb)
+			break;
+		len += 8;
+	}
+	while (len < limit && a[len] == b[len])
+		len++;
+
+	return len;
+}
+
+uint32_t zm_find(const zm_finder_t *mf, const uint8_t *p, size_t ahead,
+	size_t history, uint32_t pos, uint32_t *dist)
+{
+	const zm_params_t *params = &mf->params;
+
+	if (ahead < (size_t)params->min_match ||
+		ahead < (size_t)params->hash_bytes)
+		return 0;
+
+	uint32_t limit = (uint32_t)params->max_match;
+	if (ahead < limit)
+		limit = (uint32_t)ahead;
+
+	uint32_t best = 0, last = 0;
+	uint32_t cand = mf->head[zm_hash(mf, p)];
+
+	for (int depth = 0; cand && depth < params->depth; depth++) {
+		uint32_t d = pos + 1 - cand;
+
+		// distances only grow along a chain, anything else is a stale link
+		if (d <= last || d > mf->mask + 1 || d > history)
+			break;
+		last = d;
+
+		// a longer match has to agree at the end of the best one first
+		const uint8_t *match = p - d;
+		uint32_t len = 0;
+		if (match[best] == p[best])
+			len = zm_match_len(p, match, limit);
+
+		if (len > best) {
+			best = len;
+			*dist = d;
+			if (len >= (uint32_t)params->nice_match || len == limit)
+				break;
+		}
+		cand = mf->prev[(cand - 1) & mf->mask];
+	}
+
+	return best >= (uint32_t)params->min_match ? best : 0;
+}
+
+void zm_find_range(zm_finder_t *mf, const uint8_t *p, size_t n, size_t ahead,
+	size_t history, uint32_t pos, zm_match_t *matches)
+{
+	for (size_t i = 0; i < n; i++) {
+		matches[i].dist = 0;
+		matches[i].len = zm_find(mf, p + i, ahead - i, history + i,
+			pos + (uint32_t)i, &matches[i].dist);
+		zm_insert(mf, p + i, 1, ahead - i, pos + (uint32_t)i);
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef _ZMATCH_H
+#define _ZMATCH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*	Hash chain match finder shared by the LZ77 coders. Positions are stream
+	offsets: the latest position of every hash and, for each position of the
+	window, the one before it with the same hash. The caller keeps the
+	window of bytes in front of the position being searched.  */
+
+#define ZM_MAX_HASH_LOG 22		// cap of the 3 and 4 byte hash tables
+
+typedef struct {
+	int window_log;				// matches reach back 1 << WINDOW_LOG bytes
+	int min_match;				// shortest match reported, at least 2
+	int max_match;
+	int hash_bytes;				// bytes hashed per position, 2, 3 or 4
+	int depth;					// chain links followed per search
+	int nice_match;				// long enough to stop searching
+} zm_params_t;
+
+typedef struct {
+	zm_params_t params;
+	uint32_t *head;				// position + 1, 0 for none
+	uint32_t *prev;
+	uint32_t mask;				// window size - 1
+	int hash_log;
+} zm_finder_t;
+
+typedef struct {
+	uint32_t len;				// 0 for no match
+	uint32_t dist;
+} zm_match_t;
+
+void zm_init(zm_finder_t *mf, const zm_params_t *params);
+
+void zm_free(zm_finder_t *mf);
+
+/*	Forget every position, to start over on unrelated data.  */
+void zm_reset(zm_finder_t *mf);
+
+/*	Insert the N positions from POS, whose bytes start at P with AHEAD bytes
+	readable from there. Positions too close to the end to hash are left
+	out.  */
+void zm_insert(zm_finder_t *mf, const uint8_t *p, size_t n, size_t ahead,
+	uint32_t pos);
+
+/*	Longest match for P at POS, among the positions inserted before, of at
+	most AHEAD bytes and reaching back at most HISTORY bytes. Returns its
+	length and sets *DIST, or returns 0 if none is MIN_MATCH long.  */
+uint32_t zm_find(const zm_finder_t *mf, const uint8_t *p, size_t ahead,
+	size_t history, uint32_t pos, uint32_t *dist);
+
+/*	Length of the common prefix of A and B, up to LIMIT bytes.  */
+uint32_t zm_match_len(const uint8_t *a, const uint8_t *b, uint32_t limit);
+
+/*	zm_find, then zm_insert, for each of the N positions from POS. AHEAD
+	and HISTORY are those of P, the first position.  */
+void zm_find_range(zm_finder_t *mf, const uint8_t *p, size_t n, size_t ahead,
+	size_t history, uint32_t pos, zm_match_t *matches);
+
+#endif  // _ZMATCH_H
@@ -0,0 +1,142 @@
+#include "zmem.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define ZA_ALIGN 16u
+#define ZA_ROUND(x) (((x) + ZA_ALIGN - 1) & ~(size_t)(ZA_ALIGN - 1))
+
+struct za_chunk_t {
+	za_chunk_t *next;
+	size_t size;
+	// chunk data follows the (aligned) header
+};
+
+#define ZA_HEADER_SIZE ZA_ROUND(sizeof(za_chunk_t))
+#define ZA_DATA(chunk) ((unsigned char *)(chunk) + ZA_HEADER_SIZE)
+
+static void *default_alloc(void *opaque, size_t items, size_t size)
+{
+	(void)opaque;
+	return calloc(items, size);
+}
+
+static void default_free(void *opaque, void *address)
+{
+	(void)opaque;
+	free(address);
+}
+
+static z_alloc_func alloc_hook = default_alloc;
+static z_free_func free_hook = default_free;
+static void *hook_opaque = NULL;
+
+void z_set_allocator(z_alloc_func zalloc, z_free_func zfree, void *opaque)
+{
+	if (!zalloc || !zfree) {
+		alloc_hook = default_alloc;
+		free_hook = default_free;
+		hook_opaque = NULL;
+		return;
+	}
+
+	alloc_hook = zalloc;
+	free_hook = zfree;
+	hook_opaque = opaque;
+}
+
+void *z_malloc(size_t size)
+{
+	void *ptr = alloc_hook(hook_opaque, 1, size);
+	assert(ptr);
+	return ptr;
+}
+
+void *z_calloc(size_t items, size_t size)
+{
+	void *ptr = alloc_hook(hook_opaque, items, size);
+	assert(ptr);
+	if (alloc_hook != default_alloc)
+		memset(ptr, 0, items * size);
+	return ptr;
+}
+
+void *z_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+	void *new_ptr = z_malloc(new_size);
+
+	if (ptr) {
+		memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+		z_free(ptr);
+	}
+
+	return new_ptr;
+}
+
+void z_free(void *ptr)
+{
+	if (ptr)
+		free_hook(hook_opaque, ptr);
+}
+
+static za_chunk_t *za_chunk_create(size_t size)
+{
+	za_chunk_t *chunk = (za_chunk_t *)z_malloc(ZA_HEADER_SIZE + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	return chunk;
+}
+
+z_arena_t *za_create(size_t chunk_size)
+{
+	z_arena_t *za = (z_arena_t *)z_calloc(1, sizeof(z_arena_t));
+
+	za->chunk_size = ZA_ROUND(chunk_size ? chunk_size : ZA_DEFAULT_CHUNK);
+	za->head = za_chunk_create(za->chunk_size);
+	za->curr = za->head;
+
+	return za;
+}
+
+void za_destroy(z_arena_t *za)
+{
+	if (!za)
+		return;
+
+	za_chunk_t *chunk = za->head;
+	while (chunk) {
+		za_chunk_t *next = chunk->next;
+		z_free(chunk);
+		chunk = next;
+	}
+	z_free(za);
+}
+
+void *za_alloc(z_arena_t *za, size_t size)
+{
+	size = ZA_ROUND(size ? size : 1);
+
+	while (za->used + size > za->curr->size) {
+		/* Move on to the next chunk, appending one if the arena has never
+		grown this far */
+
+		if (!za->curr->next) {
+			size_t chunk_size = size > za->chunk_size ? size : za->chunk_size;
+			za->curr->next = za_chunk_create(chunk_size);
+		}
+		za->curr = za->curr->next;
+		za->used = 0;
+	}
+
+	void *ptr = ZA_DATA(za->curr) + za->used;
+	za->used += size;
+
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void za_reset(z_arena_t *za)
+{
+	za->curr = za->head;
+	za->used = 0;
+}
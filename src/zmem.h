@@ -0,0 +1,42 @@
+#ifndef _ZMEM_H
+#define _ZMEM_H 1
+
+#include <stddef.h>
+#include "zalloc.h"
+
+#define ZA_DEFAULT_CHUNK (1 << 16)	// 64KB, enough for a block's tables
+
+/*	Allocation wrappers honouring the hooks set by z_set_allocator. All of
+	them abort (assert) on failure, like the rest of the library.  */
+void *z_malloc(size_t size);
+
+void *z_calloc(size_t items, size_t size);
+
+/*	Grow or shrink PTR from OLD_SIZE to NEW_SIZE bytes. The hooks have no
+	realloc, so the contents are moved to a fresh allocation.  */
+void *z_realloc(void *ptr, size_t old_size, size_t new_size);
+
+void z_free(void *ptr);
+
+typedef struct za_chunk_t za_chunk_t;
+
+/*	Bump arena for per-block temporaries (huffman trees, tables, heaps).
+	Nothing is freed individually; za_reset rewinds the arena and keeps its
+	chunks, so steady-state blocks never reach the general allocator.  */
+typedef struct z_arena_t {
+	za_chunk_t *head;
+	za_chunk_t *curr;
+	size_t used;				// bytes used in CURR
+	size_t chunk_size;
+} z_arena_t;
+
+z_arena_t *za_create(size_t chunk_size);
+
+void za_destroy(z_arena_t *za);
+
+/*	Returns SIZE zeroed bytes, aligned for any scalar type.  */
+void *za_alloc(z_arena_t *za, size_t size);
+
+void za_reset(z_arena_t *za);
+
+#endif  // _ZMEM_H
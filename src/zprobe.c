@@ -0,0 +1,79 @@
+#include "deflate.h"
+#include <stdint.h>
+#include <string.h>
+#include "zhist.h"
+
+#define ZP_RUNS 8				// runs sampled across the input
+#define ZP_RUN 512				// bytes per run
+#define ZP_MIN_LEN 1024			// less is not worth a guess
+#define ZP_HASH_BITS 12
+#define ZP_MIN_MATCH 4
+#define ZP_WSIZE 32768			// matches further back are of no use
+
+/* Thresholds, entropy in hundredths of a bit per byte and matches in
+percent of the probed positions */
+
+#define ZP_STORE_ENTROPY 780
+#define ZP_STORE_MATCHES 2
+#define ZP_FAST_ENTROPY 700
+#define ZP_FAST_MATCHES 10
+
+static inline uint32_t load32(const unsigned char *p)
+{
+	uint32_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static inline uint32_t zp_hash(uint32_t word)
+{
+	return (word * 2654435761u) >> (32 - ZP_HASH_BITS);
+}
+
+int deflate_probe(const unsigned char *buf, size_t len)
+{
+	if (len < ZP_MIN_LEN)
+		return DEFLATE_PROBE_NORMAL;
+
+	/* Runs spread evenly, or all of the input when it is that short */
+
+	size_t stride = len / ZP_RUNS, run = ZP_RUN;
+	if (stride < ZP_RUN)
+		stride = run = len;
+
+	int hist[256] = {0};
+	uint32_t head[1 << ZP_HASH_BITS];	// last position + 1, 0 for none
+	size_t counted = 0, probes = 0, matches = 0;
+
+	memset(head, 0, sizeof(head));
+
+	for (size_t start = 0; start + run <= len; start += stride) {
+		zh_count(buf + start, run, hist);
+		counted += run;
+
+		/* One probe per position, no chains: enough to tell how often
+		a match is at hand */
+
+		for (size_t i = start; i + ZP_MIN_MATCH <= start + run; i++) {
+			uint32_t word = load32(buf + i);
+			uint32_t h = zp_hash(word);
+			size_t cand = head[h];
+
+			head[h] = (uint32_t)(i + 1);
+			probes++;
+
+			if (cand && i + 1 - cand <= ZP_WSIZE &&
+				load32(buf + cand - 1) == word)
+				matches++;
+		}
+	}
+
+	uint64_t entropy = zh_cost(hist, 256) * 100 / counted;
+	uint64_t match_pct = (uint64_t)matches * 100 / probes;
+
+	if (entropy >= ZP_STORE_ENTROPY && match_pct < ZP_STORE_MATCHES)
+		return DEFLATE_PROBE_STORE;
+	if (entropy >= ZP_FAST_ENTROPY || match_pct < ZP_FAST_MATCHES)
+		return DEFLATE_PROBE_FAST;
+	return DEFLATE_PROBE_NORMAL;
+}
@@ -0,0 +1,125 @@
+#include "zthreads.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+#include "zmem.h"
+
+#define ZT_MAX_THREADS 256
+
+typedef struct zt_task_t {
+	struct zt_task_t *next;
+	zt_task_func func;
+	void *arg;
+} zt_task_t;
+
+struct zt_pool_t {
+	pthread_mutex_t lock;
+	pthread_cond_t has_work;	// signalled on submit and on shutdown
+	pthread_cond_t idle;		// signalled when the last pending task ends
+	zt_task_t *head, *tail;
+	int pending;				// queued plus running tasks
+	int stop;
+	int nthreads;
+	pthread_t threads[ZT_MAX_THREADS];
+};
+
+static void *zt_worker(void *arg)
+{
+	zt_pool_t *pool = (zt_pool_t *)arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->head && !pool->stop)
+			pthread_cond_wait(&pool->has_work, &pool->lock);
+
+		if (!pool->head)
+			break;
+
+		zt_task_t *task = pool->head;
+		pool->head = task->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		task->func(task->arg);
+		z_free(task);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+zt_pool_t *zt_create(int nthreads)
+{
+	if (nthreads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = cpus > 0 ? (int)cpus : 1;
+	}
+	if (nthreads > ZT_MAX_THREADS)
+		nthreads = ZT_MAX_THREADS;
+
+	zt_pool_t *pool = (zt_pool_t *)z_calloc(1, sizeof(zt_pool_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->has_work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pool->nthreads = nthreads;
+
+	for (int i = 0; i < nthreads; i++) {
+		int err = pthread_create(&pool->threads[i], NULL, zt_worker, pool);
+		assert(err == 0);
+		(void)err;
+	}
+
+	return pool;
+}
+
+void zt_destroy(zt_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->has_work);
+	pthread_mutex_destroy(&pool->lock);
+	z_free(pool);
+}
+
+int zt_size(zt_pool_t *pool)
+{
+	return pool->nthreads;
+}
+
+void zt_submit(zt_pool_t *pool, zt_task_func func, void *arg)
+{
+	zt_task_t *task = (zt_task_t *)z_malloc(sizeof(zt_task_t));
+	task->next = NULL;
+	task->func = func;
+	task->arg = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = task;
+	else
+		pool->head = task;
+	pool->tail = task;
+	pool->pending++;
+	pthread_cond_signal(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void zt_wait(zt_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
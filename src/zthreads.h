@@ -0,0 +1,24 @@
+#ifndef _ZTHREADS_H
+#define _ZTHREADS_H 1
+
+/*	Fixed-size pool of worker threads running queued tasks in FIFO order.
+	Tasks must not submit to the pool they run on. Link with -lpthread.  */
+
+typedef void (*zt_task_func)(void *arg);
+
+typedef struct zt_pool_t zt_pool_t;
+
+/*	Start NTHREADS workers, or one per online CPU if NTHREADS <= 0.  */
+zt_pool_t *zt_create(int nthreads);
+
+/*	Stops the workers once the queue has drained.  */
+void zt_destroy(zt_pool_t *pool);
+
+int zt_size(zt_pool_t *pool);
+
+void zt_submit(zt_pool_t *pool, zt_task_func func, void *arg);
+
+/*	Block until every task submitted so far has finished.  */
+void zt_wait(zt_pool_t *pool);
+
+#endif  // _ZTHREADS_H
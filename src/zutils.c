@@ -44,30 +44,49 @@ void luts_init()
 	len_lut_init();
 }
 
-void zlib_init(z_stream_t *strm, FILE *src, FILE *dest, int mode)
+void zlib_init(z_stream_t *strm, z_io_t *io, int mode)
 {
+    strm->io = io;
+
     if (mode == Z_MODE_INFLATE) {
         strm->bws = bws_create(BW_M_READ);
-        strm->bl_arr = NULL;
-        strm->hashtable = NULL;
+        strm->seq = NULL;
     } else if (mode == Z_MODE_DEFLATE) {
-        strm->bws = bws_create(BW_M_WRITE);
-        strm->bl_arr = bl_arr_create();
-        strm->hashtable = (lz_list_t *)calloc(65536, sizeof(lz_list_t));
-        assert(strm->hashtable);
+        strm->bws = NULL;
+        bww_init(&strm->bw, strm->out);
+        strm->seq = (uint32_t *)z_malloc(CHUNK_SIZE * sizeof(uint32_t));
+
+        /* The search depth is up to each block */
+
+        zm_params_t params = {Z_WLOG, Z_MIN_MATCH, Z_MAX_MATCH, Z_MIN_MATCH,
+            0, Z_MAX_MATCH};
+        zm_init(&strm->finder, &params);
     } else {
         fputs("Invalid zlib mode\n", stderr);
         return;
     }
 
-    memset(strm->in, 0, CHUNK_SIZE);
-    memset(strm->out, 0, CHUNK_SIZE);
+    /* Mapped input is read in place, otherwise buffer it. Deflate keeps a
+    window of history in front of each block */
+
+    strm->inbuf = NULL;
+    strm->in = io->map;
+    if (!io->map) {
+        size_t history = (mode == Z_MODE_DEFLATE) ? Z_WSIZE : 0;
+        strm->inbuf = (z_byte *)z_calloc(history + CHUNK_SIZE, 1);
+        strm->in = strm->inbuf + history;
+    }
+
+    strm->arena = za_create(ZA_DEFAULT_CHUNK);
     strm->adler = 1;
     strm->sliding_window = NULL;
-    strm->src = src;
-    strm->dest = dest;
+    strm->quick_head = NULL;
+    strm->seq_len = 0;
     strm->mode = mode;
+    strm->flags = 0;
     strm->avail_in = 0;
+    strm->lookahead = 0;
+    strm->in_pos = 0;
     strm->avail_out = 0;
 	strm->eof = 0;
 	strm->total_out = 0;
@@ -78,14 +97,16 @@ void zlib_destroy(z_stream_t *strm)
     if (strm->sliding_window)
         cb_destroy(strm->sliding_window);
 
-    bws_destroy(strm->bws);
+    if (strm->bws)
+        bws_destroy(strm->bws);
+    za_destroy(strm->arena);
+    z_free(strm->inbuf);
+    zio_finish(strm->io, strm->in_pos);
 
     if (strm->mode == Z_MODE_DEFLATE) {
-        bl_arr_destroy(strm->bl_arr);
-        for (int i = 0; i < 65536; i++) {
-            lzl_clear(&strm->hashtable[i]);
-        }
-        free(strm->hashtable);
+        z_free(strm->seq);
+        z_free(strm->quick_head);
+        zm_free(&strm->finder);
     }
 }
 
@@ -94,9 +115,20 @@ void update_adler(unsigned int *adler, z_byte *vals, int count)
     unsigned s1 = *adler & 0xffff;
     unsigned s2 = (*adler >> 16) & 0xffff;
 
-	for (int i = 0; i < count; i++) {
-		s1 = (s1 + vals[i]) % ADLER_CONST;
-		s2 = (s2 + s1) % ADLER_CONST;
+	/* Reduce once per ADLER_NMAX bytes, the most S2 can take in without
+	overflowing 32 bits */
+
+	while (count > 0) {
+		int n = count < ADLER_NMAX ? count : ADLER_NMAX;
+
+		for (int i = 0; i < n; i++) {
+			s1 += vals[i];
+			s2 += s1;
+		}
+		s1 %= ADLER_CONST;
+		s2 %= ADLER_CONST;
+		vals += n;
+		count -= n;
 	}
 	*adler = s2 << 16 | s1;
 }
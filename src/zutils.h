@@ -4,10 +4,14 @@
 #include <stdio.h>
 #include "bwstream.h"
 #include "lzssutils.h"
+#include "zmatch.h"
 #include "huffman.h"
 #include "zerrcodes.h"
+#include "zmem.h"
+#include "zio.h"
 
 #define ADLER_CONST 65521
+#define ADLER_NMAX 5552
 #define DEFLATE_BTYPE_LIT 0
 #define DEFLATE_BTYPE_FIX 1
 #define DEFLATE_BTYPE_DYN 2
@@ -51,39 +55,55 @@ extern int dist_lookup_table[30];
 #define Z_MODE_INFLATE 0
 #define Z_MODE_DEFLATE 1
 #define CHUNK_SIZE (1 << 17)	// 131072 , or 128KB
-
-#define Z_EOF(file) (fgetc(file) != EOF ? fseek(file, -1, SEEK_CUR) : 1)
+#define Z_WSIZE 32768			// deflate window, kept in front of IN
+#define Z_WLOG 15
+#define Z_MIN_MATCH 4			// shortest match deflate looks for
+#define Z_MAX_MATCH 258
 
 #define UNDEFINED_ERROR (-99)
 
 typedef unsigned char z_byte;
 
 typedef struct z_stream_t {
-	FILE *src;
-	FILE *dest;
-	bw_stream_t *bws;
+	z_io_t *io;
+	bw_stream_t *bws;				// inflate: bit reader over the input
+	bw_writer_t bw;					// deflate: bit writer into OUT
 
 	circ_buff_t *sliding_window;
 
-	z_byte in[CHUNK_SIZE];
-	z_byte out[CHUNK_SIZE];
+	z_byte *in;						/* current input block; when deflating,
+									the Z_WSIZE bytes before it hold the
+									history, be it in INBUF or the mapping */
+	z_byte *inbuf;					// owned input buffer, NULL when mapped
+	z_byte out[CHUNK_SIZE + BW_SLACK];
 	int avail_in;					// total bytes in current input block
+	int lookahead;					/* bytes readable from IN, matches may
+									run past AVAIL_IN up to here */
+	size_t in_pos;					// mapped input bytes consumed so far
 	int avail_out;					// bytes written in output block buffer
 
-	backlink_array_t *bl_arr;		// for storing len-dist pairs at deflation
-	lz_list_t *hashtable;			// easy lookup for potential string matches
+	uint32_t *seq;					/* deflate: the block's tokens, one per
+									literal or match, CHUNK_SIZE at most */
+	int seq_len;
+	zm_finder_t finder;				// deflate: hash chains over the window
+	uint32_t *quick_head;			/* deflate, DEFLATE_F_FAST: latest
+									position + 1 of each hash, no chains */
+
+	z_arena_t *arena;				// per-block huffman trees and tables
 
 	unsigned int adler;
 	int mode;						// inflate/read or deflate/write
+	int flags;						// DEFLATE_F_* of deflate_flags
 
 	int eof;
-	int total_out;					/* Only use when deflating, useful for
-									accessing back-links */
+	uint64_t total_out;				/* deflate: bytes parsed so far, the
+									history behind IN; the match finder
+									gets its low 32 bits */
 } z_stream_t;
 
 void luts_init();
 
-void zlib_init(z_stream_t *strm, FILE *src, FILE *dest, int mode);
+void zlib_init(z_stream_t *strm, z_io_t *io, int mode);
 
 void zlib_destroy(z_stream_t *strm);
 